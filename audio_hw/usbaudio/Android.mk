@@ -24,7 +24,8 @@ LOCAL_MODULE := audio.usb.$(TARGET_DEVICE)
 LOCAL_MODULE_PATH := $(TARGET_OUT_SHARED_LIBRARIES)/hw
 
 LOCAL_SRC_FILES := audio_hw.c
-LOCAL_C_INCLUDES += external/tinyalsa/include
+LOCAL_C_INCLUDES += external/tinyalsa/include \
+	$(LOCAL_PATH)/../../audio_pc
 LOCAL_SHARED_LIBRARIES := liblog libcutils libtinyalsa
 
 LOCAL_MODULE_TAGS := optional
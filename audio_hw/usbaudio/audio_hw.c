@@ -39,6 +39,8 @@
 #include <sound/asound.h>
 #include <unistd.h>
 
+#include "hal_stats.h"
+
 #define PCM_DEV_STR "pcm"
 #define USB_AUDIO_STR "USB Audio"
 #define MAX_PATH_LEN 30
@@ -54,6 +56,16 @@ struct pcm_config pcm_config = {
     .format = PCM_FORMAT_S16_LE,
 };
 
+/* telemetry printed by out_dump(), durations are in microseconds */
+struct out_stats {
+    struct stats_hist write_us;     /* out_write() */
+    struct stats_hist pcm_write_us;
+    struct stats_hist kernel_frames;    /* queued in the pcm at write time */
+    uint64_t write_errors;
+    uint64_t standby;
+    uint64_t resume;
+};
+
 struct audio_device {
     struct audio_hw_device hw_device;
 
@@ -70,6 +82,13 @@ struct stream_out {
     struct pcm *pcm;
     bool standby;
 
+    /* frames written since the stream was opened, and at the last exit
+       from standby */
+    uint64_t written;
+    uint64_t standby_written;
+
+    struct out_stats stats;
+
     struct audio_device *dev;
 };
 
@@ -122,7 +141,9 @@ static int start_output_stream(struct stream_out *out)
     if (sample_rate)
         pcm_config.rate = sample_rate;
 
-    out->pcm = pcm_open(adev->card, adev->device, PCM_OUT, &pcm_config);
+    /* monotonic timestamps, for the presentation position */
+    out->pcm = pcm_open(adev->card, adev->device, PCM_OUT | PCM_MONOTONIC,
+                        &pcm_config);
 
     if (out->pcm && !pcm_is_ready(out->pcm)) {
         ALOGE("pcm_open() failed: %s", pcm_get_error(out->pcm));
@@ -177,6 +198,7 @@ static int out_standby(struct audio_stream *stream)
     pthread_mutex_lock(&out->lock);
 
     if (!out->standby) {
+        stats_inc(&out->stats.standby);
         pcm_close(out->pcm);
         out->pcm = NULL;
         out->standby = true;
@@ -192,6 +214,18 @@ static int out_standby(struct audio_stream *stream)
 
 static int out_dump(const struct audio_stream *stream, int fd)
 {
+    struct stream_out *out = (struct stream_out *)stream;
+    struct out_stats *stats = &out->stats;
+
+    stats_print(fd, " output %p: %u Hz\n", out,
+                out_get_sample_rate(stream));
+    stats_print_hist(fd, "write", "us", &stats->write_us);
+    stats_print_hist(fd, "pcm_write", "us", &stats->pcm_write_us);
+    stats_print_hist(fd, "kernel_frames", "frames", &stats->kernel_frames);
+    stats_print_count(fd, "write_errors", &stats->write_errors);
+    stats_print_count(fd, "standby", &stats->standby);
+    stats_print_count(fd, "resume", &stats->resume);
+
     return 0;
 }
 
@@ -241,34 +275,64 @@ static int out_set_volume(struct audio_stream_out *stream, float left,
     return -ENOSYS;
 }
 
+/* must be called with output stream mutex locked */
+static int out_get_pending_frames(struct stream_out *out, uint64_t *frames,
+                                  struct timespec *timestamp)
+{
+    unsigned int avail;
+
+    if (out->standby || !out->pcm)
+        return -ENODATA;
+    if (pcm_get_htimestamp(out->pcm, &avail, timestamp) < 0)
+        return -ENODATA;
+
+    *frames = pcm_get_buffer_size(out->pcm) - avail;
+    return 0;
+}
+
 static ssize_t out_write(struct audio_stream_out *stream, const void* buffer,
                          size_t bytes)
 {
     int ret;
     struct stream_out *out = (struct stream_out *)stream;
+    int64_t start_us = stats_now_us(), pcm_start_us;
+    uint64_t kernel_frames;
+    struct timespec timestamp;
 
     ALOGV("%s enter",__func__);
 
     pthread_mutex_lock(&out->dev->lock);
     pthread_mutex_lock(&out->lock);
+    /* frames that fail to play are dropped, they count as written too */
+    out->written += bytes / audio_stream_frame_size(&stream->common);
     if (out->standby) {
         ret = start_output_stream(out);
         if (ret != 0) {
             goto err;
         }
         out->standby = false;
+        out->standby_written = out->written -
+                bytes / audio_stream_frame_size(&stream->common);
+        stats_inc(&out->stats.resume);
     }
 
     if(!out->pcm){
        ALOGD("%s: null handle to write - device already closed",__func__);
        goto err;
     }
+    if (out_get_pending_frames(out, &kernel_frames, &timestamp) == 0)
+        stats_hist_add(&out->stats.kernel_frames, kernel_frames);
+    pcm_start_us = stats_now_us();
     ret = pcm_write(out->pcm, (void *)buffer, bytes);
+    stats_hist_add_since(&out->stats.pcm_write_us, pcm_start_us);
+    if (ret != 0)
+        stats_inc(&out->stats.write_errors);
 
     ALOGV("%s: pcm_write returned = %d",__func__,ret);
 
     pthread_mutex_unlock(&out->lock);
     pthread_mutex_unlock(&out->dev->lock);
+    stats_hist_add_since(&out->stats.write_us, start_us);
 
     ALOGV("%s exit",__func__);
 
@@ -283,6 +347,7 @@ err:
         usleep(bytes * 1000000 / audio_stream_frame_size(&stream->common) /
                out_get_sample_rate(&stream->common));
     }
+    stats_hist_add_since(&out->stats.write_us, start_us);
 
     return bytes;
 }
@@ -290,7 +355,38 @@ err:
 static int out_get_render_position(const struct audio_stream_out *stream,
                                    uint32_t *dsp_frames)
 {
-    return -EINVAL;
+    struct stream_out *out = (struct stream_out *)stream;
+    struct timespec timestamp;
+    uint64_t pending;
+    uint64_t written;
+    int ret;
+
+    pthread_mutex_lock(&out->lock);
+    ret = out_get_pending_frames(out, &pending, &timestamp);
+    if (ret == 0) {
+        written = out->written - out->standby_written;
+        *dsp_frames = written > pending ? written - pending : 0;
+    }
+    pthread_mutex_unlock(&out->lock);
+
+    return ret;
+}
+
+static int out_get_presentation_position(const struct audio_stream_out *stream,
+                                         uint64_t *frames,
+                                         struct timespec *timestamp)
+{
+    struct stream_out *out = (struct stream_out *)stream;
+    uint64_t pending;
+    int ret;
+
+    pthread_mutex_lock(&out->lock);
+    ret = out_get_pending_frames(out, &pending, timestamp);
+    if (ret == 0)
+        *frames = out->written > pending ? out->written - pending : 0;
+    pthread_mutex_unlock(&out->lock);
+
+    return ret;
 }
 
 static int out_add_audio_effect(const struct audio_stream *stream, effect_handle_t effect)
@@ -418,6 +514,7 @@ static int adev_open_output_stream(struct audio_hw_device *dev,
     out->stream.write = out_write;
     out->stream.get_render_position = out_get_render_position;
     out->stream.get_next_write_timestamp = out_get_next_write_timestamp;
+    out->stream.get_presentation_position = out_get_presentation_position;
 
     out->dev = adev;
 
@@ -526,6 +623,10 @@ static void adev_close_input_stream(struct audio_hw_device *dev,
 
 static int adev_dump(const audio_hw_device_t *device, int fd)
 {
+    struct audio_device *adev = (struct audio_device *)device;
+
+    stats_print(fd, " card %d, device %d\n", adev->card, adev->device);
+
     return 0;
 }
 
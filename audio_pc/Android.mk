@@ -15,19 +15,41 @@
 ifeq ($(AUDIO_HAL), audio_pc)
 LOCAL_PATH := $(call my-dir)
 
+# The AVX2 downmix kernel is the only code built with -mavx2, the HAL
+# calls it once it has checked the CPU.
+ifneq ($(filter x86 x86_64,$(TARGET_ARCH)),)
+include $(CLEAR_VARS)
+
+LOCAL_MODULE := libaudio_pc_downmix_avx2
+LOCAL_SRC_FILES := downmix_avx2.c
+LOCAL_CFLAGS += -mavx2
+LOCAL_MODULE_TAGS := optional
+
+include $(BUILD_STATIC_LIBRARY)
+endif
+
 include $(CLEAR_VARS)
 
 LOCAL_MODULE := audio.primary.$(TARGET_PRODUCT)
 LOCAL_MODULE_PATH := $(TARGET_OUT_SHARED_LIBRARIES)/hw
 LOCAL_SRC_FILES := \
 	audio_hw.c \
-	audio_route.c
+	audio_route.c \
+	card_registry.c \
+	downmix.c \
+	format_convert.c \
+	poly_resampler.c \
+	sw_mixer.c
 LOCAL_CFLAGS += -DLOG_NDEBUG=0
 LOCAL_C_INCLUDES += \
 	external/tinyalsa/include \
 	external/expat/lib \
 	$(call include-path-for, audio-utils)
 LOCAL_SHARED_LIBRARIES := liblog libcutils libtinyalsa libaudioutils libexpat
+ifneq ($(filter x86 x86_64,$(TARGET_ARCH)),)
+LOCAL_CFLAGS += -DDOWNMIX_AVX2
+LOCAL_STATIC_LIBRARIES := libaudio_pc_downmix_avx2
+endif
 LOCAL_MODULE_TAGS := optional
 
 include $(BUILD_SHARED_LIBRARY)
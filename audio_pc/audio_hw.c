@@ -19,6 +19,7 @@
 
 #include <errno.h>
 #include <pthread.h>
+#include <sched.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -28,6 +29,8 @@
 
 #include <linux/ioctl.h>
 #include <sys/time.h>
+#include <sys/timerfd.h>
+#include <time.h>
 
 #include <cutils/log.h>
 #include <cutils/properties.h>
@@ -44,8 +47,13 @@
 #include <audio_utils/resampler.h>
 
 #include "audio_route.h"
+#include "card_registry.h"
+#include "downmix.h"
+#include "format_convert.h"
+#include "hal_stats.h"
+#include "poly_resampler.h"
+#include "sw_mixer.h"
 
-#define CARD_CTRL_PATH "/dev/snd/controlC%u"
 #define MAX_CARDS 4
 #define MAX_INTERNAL_CARDS 2
 
@@ -66,7 +74,30 @@
 #define USB_MIC_CAPTURE_VOLUME_STR "Mic Capture Volume"
 #define USB_MIC_CAPTURE_VOLUME_DEFAULT "10"
 
-#define CODEC_CHIP_NAME_PATH "/sys/class/sound/hwC%uD0/chip_name"
+/* controls set on the USB card when routing to a USB mic */
+static const struct audio_route_control usb_mic_controls[] = {
+    { USB_MIC_CAPTURE_SWITCH_STR, USB_MIC_CAPTURE_SWITCH_ON },
+    { USB_MIC_CAPTURE_VOLUME_STR, USB_MIC_CAPTURE_VOLUME_DEFAULT },
+};
+
+/* set to 1 to reload the mixer paths whenever the xml is changed */
+#define MIXER_RELOAD_PROPERTY "persist.audio.mixer_reload"
+
+/* set to 1 to render playback straight into the mmap'ed pcm buffer */
+#define OUT_MMAP_PROPERTY "persist.audio.out_mmap"
+
+/* set to 1 to capture straight from the mmap'ed pcm buffer */
+#define IN_MMAP_PROPERTY "persist.audio.in_mmap"
+
+/* set to 1 to mix all the output streams into a single pcm */
+#define OUT_MIXER_PROPERTY "persist.audio.out_mixer"
+
+/* milliseconds of silence queued after an output underrun, 0 for none */
+#define OUT_XRUN_PREFILL_PROPERTY "persist.audio.out_xrun_prefill"
+#define OUT_XRUN_PREFILL_DEFAULT "10"
+
+/* set to 0 to round rather than dither the samples converted to S16 */
+#define OUT_DITHER_PROPERTY "persist.audio.out_dither"
 
 #define OTHER_DEVICE 0
 
@@ -78,6 +109,29 @@
 #define OUT_SHORT_PERIOD_COUNT 2
 #define OUT_LONG_PERIOD_COUNT 8
 #define OUT_SAMPLING_RATE 44100
+/* AUDIO_OUTPUT_FLAG_FAST streams, for games and UI sounds */
+#define OUT_FAST_PERIOD_SIZE 128
+#define OUT_FAST_PERIOD_COUNT 4
+#define OUT_FAST_QUEUED_PERIODS 2
+/* AUDIO_OUTPUT_FLAG_DEEP_BUFFER streams, for music */
+#define OUT_DEEP_PERIOD_SIZE 4096
+#define OUT_DEEP_PERIOD_COUNT 4
+#define OUT_DEEP_QUEUED_PERIODS 4
+#define OUT_MIXER_MAX_STREAMS 8
+/* periods a stream can queue ahead of the mixer */
+#define OUT_MIXER_RING_PERIODS 4
+/* periods of silence mixed before the mixer pcm goes to standby */
+#define OUT_MIXER_IDLE_PERIODS 32
+
+/* how stereo playback is made mono for a mono pcm */
+#define OUT_DOWNMIX_MODE DOWNMIX_AVERAGE
+/* resampler quality of playback, and of capture for voice or other uses */
+#define OUT_RESAMPLER_QUALITY POLY_RESAMPLER_HIGH
+/* frames resampled aside when the mmap window stops at the end of the buffer */
+#define OUT_MMAP_BOUNCE_FRAMES 64
+#define IN_VOICE_RESAMPLER_QUALITY POLY_RESAMPLER_LOW
+#define IN_RESAMPLER_QUALITY POLY_RESAMPLER_MEDIUM
+#define IN_VOICE_MAX_RATE 16000
 
 #define IN_PERIOD_SIZE 1024
 #define IN_PERIOD_COUNT 4
@@ -87,10 +141,17 @@
 #define SCO_PERIOD_COUNT 4
 #define SCO_SAMPLING_RATE 8000
 
+/* in_get_parameters() key, replied as "<frames>,<CLOCK_MONOTONIC ns>" */
+#define IN_CAPTURE_POSITION_KEY "capture_position"
+
 /* minimum sleep time in out_write() when write threshold is not reached */
 #define MIN_WRITE_SLEEP_US 2000
+#define NSEC_PER_SEC 1000000000LL
 #define MAX_WRITE_SLEEP_US ((OUT_PERIOD_SIZE * OUT_SHORT_PERIOD_COUNT * 1000000) \
                                 / OUT_SAMPLING_RATE)
+/* the write threshold raise after an underrun drops by a period for every
+   such time without one */
+#define OUT_UNDERRUN_DECAY_MS 2000
 
 enum {
     OUT_BUFFER_TYPE_UNKNOWN,
@@ -98,6 +159,13 @@ enum {
     OUT_BUFFER_TYPE_LONG,
 };
 
+/* Output profiles, chosen from the flags of the stream */
+enum {
+    OUT_PROFILE_PRIMARY,
+    OUT_PROFILE_FAST,
+    OUT_PROFILE_DEEP_BUFFER,
+};
+
 /* Enumeration of all MAX_CARDS possible cards */
 enum {
     AUDIO_CARD_PCH = 0,
@@ -115,6 +183,24 @@ struct pcm_config pcm_config_out = {
     .start_threshold = OUT_PERIOD_SIZE * OUT_SHORT_PERIOD_COUNT,
 };
 
+struct pcm_config pcm_config_out_fast = {
+    .channels = 2,
+    .rate = OUT_SAMPLING_RATE,
+    .period_size = OUT_FAST_PERIOD_SIZE,
+    .period_count = OUT_FAST_PERIOD_COUNT,
+    .format = PCM_FORMAT_S16_LE,
+    .start_threshold = OUT_FAST_PERIOD_SIZE,
+};
+
+struct pcm_config pcm_config_out_deep = {
+    .channels = 2,
+    .rate = OUT_SAMPLING_RATE,
+    .period_size = OUT_DEEP_PERIOD_SIZE,
+    .period_count = OUT_DEEP_PERIOD_COUNT,
+    .format = PCM_FORMAT_S16_LE,
+    .start_threshold = OUT_DEEP_PERIOD_SIZE * 2,
+};
+
 struct pcm_config pcm_config_in = {
     .channels = 2,
     .rate = IN_SAMPLING_RATE,
@@ -148,6 +234,41 @@ struct audio_card {
     int device;
 };
 
+/* telemetry printed by the dump hooks, durations are in microseconds */
+struct out_stats {
+    struct stats_hist write_us;     /* out_write() */
+    struct stats_hist pace_us;      /* waiting for the write threshold */
+    struct stats_hist pcm_write_us;
+    struct stats_hist kernel_frames;    /* queued in the pcm at write time */
+    struct stats_hist underrun_boost;   /* threshold raise at an underrun */
+    uint64_t underruns;
+    uint64_t prefill_frames;    /* silence queued after the underruns */
+    uint64_t standby;
+    uint64_t resume;
+};
+
+struct in_stats {
+    struct stats_hist read_us;      /* in_read() */
+    struct stats_hist pcm_read_us;
+    uint64_t overruns;
+    uint64_t read_errors;
+    uint64_t standby;
+    uint64_t resume;
+};
+
+struct device_stats {
+    struct stats_hist route_us;     /* routing by route_thread */
+    uint64_t select_devices;
+};
+
+/* what the stream write and read paths need from the device */
+struct dev_state {
+    unsigned int out_device;
+    bool screen_off;
+    bool in_active;
+    enum downmix_mode in_downmix;
+};
+
 struct audio_device {
     struct audio_hw_device hw_device;
 
@@ -156,16 +277,74 @@ struct audio_device {
     unsigned int in_device;
     bool standby;
     bool mic_mute;
+    bool out_mmap;
+    bool in_mmap;
+    unsigned int out_xrun_prefill_ms;
+    bool out_dither;
+    enum downmix_mode in_downmix;   /* how a stereo mic is made mono */
     struct audio_route *ar;
     int orientation;
     bool screen_off;
 
+    struct card_registry *cards;
     struct audio_card card[MAX_CARDS];
     int card_out_index;
     int card_in_index;
 
     struct stream_out *active_out;
     struct stream_in *active_in;
+
+    /*
+     * Copy of the fields in dev_state, published by dev_state_publish()
+     * under lock and read by dev_state_read() without it, so that a slow
+     * holder of lock does not stall the streams. state_seq is odd while
+     * state is being written.
+     */
+    uint32_t state_seq;
+    struct dev_state state;
+
+    /*
+     * Mixer routing is done by route_thread. Requests only bump route_seq,
+     * so a burst of them is coalesced into a single route of the latest
+     * devices. Both counters are protected by lock.
+     */
+    pthread_t route_thread;
+    pthread_cond_t route_cond;      /* signalled when route_seq changes */
+    pthread_cond_t route_done_cond; /* signalled when route_done_seq changes */
+    unsigned int route_seq;
+    unsigned int route_done_seq;
+    bool route_exit;
+
+    /*
+     * With the software mixer, mixer_out owns the pcm and mixer_thread
+     * writes the sum of the other output streams to it. Those streams
+     * only queue frames into their ring, so writing them takes neither
+     * lock nor mixer_lock. mixer_lock protects mixer_streams and
+     * mixer_exit.
+     */
+    struct stream_out *mixer_out;
+    pthread_t mixer_thread;
+    pthread_mutex_t mixer_lock;
+    pthread_cond_t mixer_cond;  /* signalled when a ring stops being empty */
+    struct stream_out *mixer_streams[OUT_MIXER_MAX_STREAMS];
+    bool mixer_exit;
+
+    struct device_stats stats;
+};
+
+/* what route_thread needs from the device to route it */
+struct route_state {
+    struct audio_route *ar;
+    struct card_registry *cards;
+    unsigned int out_device;
+    unsigned int in_device;
+    int orientation;
+    int pch_slot;
+    int hdmi_slot;
+    int usb_slot;
+    int card_out_index;
+    int card_in_index;
+    enum downmix_mode in_downmix;
 };
 
 struct stream_out {
@@ -174,7 +353,10 @@ struct stream_out {
     pthread_mutex_t lock; /* see note below on mutex acquisition order */
     struct pcm *pcm;
     struct pcm_config *pcm_config;
+    struct pcm_config config;   /* pcm_config of the open pcm */
     bool standby;
+    bool mmap;          /* pcm opened with PCM_MMAP */
+    bool mmap_running;  /* pcm_start() done since the last prepare */
 
     struct resampler_itfe *resampler;
     int16_t *buffer;
@@ -182,7 +364,31 @@ struct stream_out {
 
     int write_threshold;
     int cur_write_threshold;
+    int underrun_boost;     /* frames added to write_threshold since the
+                               last underruns */
+    int64_t boost_ns;       /* when underrun_boost was last raised or
+                               decayed */
     int buffer_type;
+    int profile;
+    const struct pcm_config *profile_config;    /* before rate negotiation */
+    int pace_fd;    /* timerfd out_write() waits on, -1 to use usleep() */
+    uint32_t sample_rate;
+    audio_format_t format;
+    enum sample_format sample_format;       /* of format */
+    enum sample_format pcm_sample_format;   /* of the open pcm */
+    void *convert_buffer;   /* frames converted to pcm_sample_format */
+    size_t convert_size;
+    struct format_dither dither;
+    struct sw_ring *ring;   /* frames queued to the mixer, NULL if the
+                               stream owns its pcm */
+
+    /* stream frames written since the stream was opened, and at the last
+       exit from standby */
+    uint64_t written;
+    uint64_t standby_written;
+    uint64_t presented;     /* the last position out_get_position() gave */
+
+    struct out_stats stats;
 
     struct audio_device *dev;
 };
@@ -193,15 +399,39 @@ struct stream_in {
     pthread_mutex_t lock; /* see note below on mutex acquisition order */
     struct pcm *pcm;
     struct pcm_config *pcm_config;
+    struct pcm_config config;   /* pcm_config of the open pcm */
     bool standby;
 
     unsigned int requested_rate;
+    audio_format_t format;
+    enum sample_format sample_format;   /* of format, the pcm is S16 */
+    int16_t *convert_buffer;    /* frames to convert to sample_format */
+    size_t convert_size;
     struct resampler_itfe *resampler;
     struct resampler_buffer_provider buf_provider;
     int16_t *buffer;
     size_t buffer_size;
     size_t frames_in;
     int read_status;
+    enum downmix_mode downmix;
+
+    /* in mmap mode frames_in counts down the mmap_frames frames at
+       mmap_area, which are committed once they have all been used */
+    bool mmap;
+    int16_t *mmap_area;
+    unsigned int mmap_offset;
+    unsigned int mmap_frames;
+
+    /* capture accounting, see in_account_frames() */
+    uint64_t pcm_frames;        /* pcm frames consumed since the pcm opened */
+    uint64_t check_frames;      /* pcm_frames plus the available frames, */
+    int64_t check_ns;           /* at this time of the last check, 0 if none */
+    uint64_t frames_read;       /* stream frames returned by in_read() */
+    uint64_t frames_dropped;    /* stream frames the hardware dropped */
+    uint32_t frames_lost;       /* stream frames lost since the last
+                                   in_get_input_frames_lost() */
+
+    struct in_stats stats;
 
     struct audio_device *dev;
 };
@@ -216,6 +446,7 @@ enum {
 static int init_cards_and_route(struct audio_device *adev, bool report_card_errors);
 static uint32_t out_get_sample_rate(const struct audio_stream *stream);
 static size_t out_get_buffer_size(const struct audio_stream *stream);
+static uint32_t out_get_channels(const struct audio_stream *stream);
 static audio_format_t out_get_format(const struct audio_stream *stream);
 static uint32_t in_get_sample_rate(const struct audio_stream *stream);
 static size_t in_get_buffer_size(const struct audio_stream *stream);
@@ -233,36 +464,57 @@ static void release_buffer(struct resampler_buffer_provider *buffer_provider,
 
 /* Helper functions */
 
-static void retrieve_codec_name(char *codec_name_path, char *codec_name, int size)
+static int64_t timespec_to_ns(const struct timespec *ts)
 {
-    int fd, cnt;
+    return ts->tv_sec * NSEC_PER_SEC + ts->tv_nsec;
+}
 
-    fd = open(codec_name_path, O_RDONLY);
-    if (fd == -1) {
-        ALOGE("Failed to open %s", codec_name_path);
-        /* If no codec name file, then use unknown. */
-        return;
-    } else {
-        cnt = read(fd, codec_name, size);
-        if (cnt <= 0) {
-            ALOGE("Failed to read vendor name");
-        } else {
-           codec_name[cnt-1] = '\0';
-        }
-        close(fd);
-    }
+/* must be called with hw device mutex locked, after any change of the
+   fields in dev_state */
+static void dev_state_publish(struct audio_device *adev)
+{
+    struct dev_state *state = &adev->state;
+    uint32_t seq = adev->state_seq;
+
+    __atomic_store_n(&adev->state_seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&state->out_device, adev->out_device, __ATOMIC_RELAXED);
+    __atomic_store_n(&state->screen_off, adev->screen_off, __ATOMIC_RELAXED);
+    __atomic_store_n(&state->in_active, adev->active_in != NULL,
+                     __ATOMIC_RELAXED);
+    __atomic_store_n(&state->in_downmix, adev->in_downmix, __ATOMIC_RELAXED);
+    __atomic_store_n(&adev->state_seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+/* takes no lock, retries while dev_state_publish() runs */
+static void dev_state_read(const struct audio_device *adev,
+                           struct dev_state *state)
+{
+    const struct dev_state *src = &adev->state;
+    uint32_t seq;
+
+    do {
+        while ((seq = __atomic_load_n(&adev->state_seq,
+                                      __ATOMIC_ACQUIRE)) & 1)
+            sched_yield();
+        state->out_device = __atomic_load_n(&src->out_device,
+                                            __ATOMIC_RELAXED);
+        state->screen_off = __atomic_load_n(&src->screen_off,
+                                            __ATOMIC_RELAXED);
+        state->in_active = __atomic_load_n(&src->in_active,
+                                           __ATOMIC_RELAXED);
+        state->in_downmix = __atomic_load_n(&src->in_downmix,
+                                            __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while (__atomic_load_n(&adev->state_seq, __ATOMIC_RELAXED) != seq);
 }
 
 static void find_card_slot(struct audio_device *adev)
 {
-    int slot_num;
+    unsigned int slot_num;
     int internal_cards_found;
-    int retval, fd;
-    char control_path[PATH_MAX];
-    char codec_name_path[PATH_MAX];
-    char codec_name[PATH_MAX];
-    char error_str[255];
-    struct snd_ctl_card_info card_info;
+    struct card_registry_info info;
+    const char *codec_name;
 
     adev->card[AUDIO_CARD_HDMI].card_slot = CARD_SLOT_NOT_FOUND;
     adev->card[AUDIO_CARD_PCH].card_slot = CARD_SLOT_NOT_FOUND;
@@ -271,62 +523,48 @@ static void find_card_slot(struct audio_device *adev)
 
     internal_cards_found = 0;
 
-        for (slot_num = 0; slot_num < MAX_CARDS; slot_num++) {
+        for (slot_num = 0; slot_num < CARD_REGISTRY_MAX_CARDS; slot_num++) {
             if (internal_cards_found == MAX_INTERNAL_CARDS)
                 return;
 
-            snprintf(control_path, sizeof(control_path), CARD_CTRL_PATH,
-                     slot_num);
-
-            fd = open(control_path, O_RDWR);
-            ALOGV("[%d][%d]find_card_slot: open %s fd=%d",
-                  slot_num, internal_cards_found, control_path, fd);
-            if (fd == -1) {
-                strerror_r(errno, error_str, sizeof(error_str));
-                ALOGE("%s", error_str);
-            }
-            else {
-                if ((retval = ioctl(fd, SNDRV_CTL_IOCTL_CARD_INFO,
-                                    &card_info)) < 0) {
-                    ALOGE("find_card_slot: ioctl() failed. retval=%d", retval);
-                    close(fd);
-                    continue;
-                }
-                close(fd);
-                if (strncmp(INTERNAL_DRIVER_STR, (char *) &card_info.driver[0],
-                            strlen(INTERNAL_DRIVER_STR)) == 0) {
-                    snprintf(codec_name_path, sizeof(codec_name_path), CODEC_CHIP_NAME_PATH, slot_num);
-                    retrieve_codec_name((char*) &codec_name_path, (char*) &codec_name, sizeof(codec_name));
-                    if ((strncmp(codec_name, "ALC262", strlen(codec_name)) == 0) ||
-                        (strncmp(codec_name, "ALC283", strlen(codec_name)) == 0) ||
-                        (strncmp(codec_name, "92HD95", strlen(codec_name)) == 0)) {
-                        if (strncmp(HDMI_ID_STR, (char *) card_info.id, strlen(HDMI_ID_STR)) == 0) {
-                            if (adev->card[AUDIO_CARD_PCH].card_slot == CARD_SLOT_NOT_FOUND) {
-                                adev->card[AUDIO_CARD_PCH].card_slot = slot_num;
-                                adev->card[AUDIO_CARD_PCH].device = PCH_DEVICE;
-                                adev->card[AUDIO_CARD_HDMI].card_slot = slot_num;
-                                adev->card[AUDIO_CARD_HDMI].device = HDMI_DEVICE;
-                                ALOGV("Set PCH slot %d", slot_num);
-                            }
-                            return;
+            if (!card_registry_get(adev->cards, slot_num, &info))
+                continue;
+            ALOGV("[%u][%d]find_card_slot: %s %s %s", slot_num,
+                  internal_cards_found, info.driver, info.id, info.codec);
+
+            if (strncmp(INTERNAL_DRIVER_STR, info.driver,
+                        strlen(INTERNAL_DRIVER_STR)) == 0) {
+                codec_name = info.codec;
+                if (codec_name[0] &&
+                    ((strncmp(codec_name, "ALC262", strlen(codec_name)) == 0) ||
+                    (strncmp(codec_name, "ALC283", strlen(codec_name)) == 0) ||
+                    (strncmp(codec_name, "92HD95", strlen(codec_name)) == 0))) {
+                    if (strncmp(HDMI_ID_STR, info.id, strlen(HDMI_ID_STR)) == 0) {
+                        if (adev->card[AUDIO_CARD_PCH].card_slot == CARD_SLOT_NOT_FOUND) {
+                            adev->card[AUDIO_CARD_PCH].card_slot = slot_num;
+                            adev->card[AUDIO_CARD_PCH].device = PCH_DEVICE;
+                            adev->card[AUDIO_CARD_HDMI].card_slot = slot_num;
+                            adev->card[AUDIO_CARD_HDMI].device = HDMI_DEVICE;
+                            ALOGV("Set PCH slot %u", slot_num);
+                        }
+                        return;
+                    }
+                } else {
+                    if ((strncmp(HDMI_ID_STR, info.id,
+                            strlen(HDMI_ID_STR)) == 0)) {
+                        if (adev->card[AUDIO_CARD_HDMI].card_slot == CARD_SLOT_NOT_FOUND) {
+                            adev->card[AUDIO_CARD_HDMI].card_slot = slot_num;
+                            adev->card[AUDIO_CARD_HDMI].device = HDMI_DEVICE;
+                            internal_cards_found++;
+                            ALOGV("Set HDMI slot %u", slot_num);
                         }
-                    } else {
-                        if ((strncmp(HDMI_ID_STR, (char *) card_info.id,
-                                strlen(HDMI_ID_STR)) == 0)) {
-                            if (adev->card[AUDIO_CARD_HDMI].card_slot == CARD_SLOT_NOT_FOUND) {
-                                adev->card[AUDIO_CARD_HDMI].card_slot = slot_num;
-                                adev->card[AUDIO_CARD_HDMI].device = HDMI_DEVICE;
-                                internal_cards_found++;
-                                ALOGV("Set HDMI slot %d", slot_num);
-                            }
-                        } else if (strncmp(PCH_ID_STR, (char *) card_info.id, strlen(PCH_ID_STR)) == 0) {
-                            if (adev->card[AUDIO_CARD_PCH].card_slot ==
-                                CARD_SLOT_NOT_FOUND) {
-                                adev->card[AUDIO_CARD_PCH].card_slot = slot_num;
-                                adev->card[AUDIO_CARD_PCH].device = PCH_DEVICE;
-                                internal_cards_found++;
-                                ALOGV("Set PCH slot %d", slot_num);
-                            }
+                    } else if (strncmp(PCH_ID_STR, info.id, strlen(PCH_ID_STR)) == 0) {
+                        if (adev->card[AUDIO_CARD_PCH].card_slot ==
+                            CARD_SLOT_NOT_FOUND) {
+                            adev->card[AUDIO_CARD_PCH].card_slot = slot_num;
+                            adev->card[AUDIO_CARD_PCH].device = PCH_DEVICE;
+                            internal_cards_found++;
+                            ALOGV("Set PCH slot %u", slot_num);
                         }
                     }
                 }
@@ -334,52 +572,25 @@ static void find_card_slot(struct audio_device *adev)
         }
 }
 
-static bool find_usb_card_slot(struct audio_device *adev)
+/* returns the slot of the first USB card, skipping the internal ones */
+static int find_usb_card_slot(struct card_registry *cards, int pch_slot,
+                              int hdmi_slot)
 {
-    int slot_num;
-    int retval, fd;
-    char control_path[PATH_MAX];
-    char error_str[255];
-    struct snd_ctl_card_info card_info;
-
-    adev->card[AUDIO_CARD_USB].card_slot = CARD_SLOT_NOT_FOUND;
+    uint32_t skip_slots = 0;
 
-    for (slot_num = 0; (slot_num < MAX_CARDS); slot_num++) {
-        if (adev->card[AUDIO_CARD_PCH].card_slot == slot_num)
-            continue;
-        if (adev->card[AUDIO_CARD_HDMI].card_slot == slot_num)
-            continue;
-
-        snprintf(control_path, sizeof(control_path), CARD_CTRL_PATH,
-                 slot_num);
-        fd = open(control_path, O_RDWR);
-        ALOGV("find_usb_card_slot: open %s fd=%d", control_path, fd);
-        if (fd == -1) {
-            strerror_r(errno, error_str, sizeof(error_str));
-            ALOGE("%s", error_str);
-        }
-        else {
-            if ((retval = ioctl(fd, SNDRV_CTL_IOCTL_CARD_INFO,
-                                &card_info)) < 0) {
-                ALOGE("find_usb_card_slot: ioctl() failed. retval=%d",
-                      retval);
-                close(fd);
-                continue;
-            }
-            close(fd);
-            if (strncmp(USB_DRIVER_STR, (char *) card_info.driver,
-                        strlen(USB_DRIVER_STR)) == 0) {
-                adev->card[AUDIO_CARD_USB].card_slot = slot_num;
-                adev->card[AUDIO_CARD_USB].device = USB_DEVICE;
-                return(true);
-            }
-        }
-    }
+    if (pch_slot != CARD_SLOT_NOT_FOUND)
+        skip_slots |= 1u << pch_slot;
+    if (hdmi_slot != CARD_SLOT_NOT_FOUND)
+        skip_slots |= 1u << hdmi_slot;
 
-    return(false);
+    return card_registry_find_driver(cards, USB_DRIVER_STR, skip_slots);
 }
 
-static void select_devices(struct audio_device *adev) {
+/*
+ * Routes the mixer for the devices of the state and updates its card
+ * indices. Only called from route_thread, without the hw device mutex.
+ */
+static void route_devices(struct route_state *state) {
     int headphone_on;
     int headset_on;
     int speaker_on;
@@ -388,65 +599,77 @@ static void select_devices(struct audio_device *adev) {
     int hdmi_on;
     int usb_out_on;
     int usb_in_on;
-    int ret;
-    ret =  init_cards_and_route(adev, true);
-    if (ret < 0){
-        return;
-    }
-
-    headphone_on = adev->out_device & AUDIO_DEVICE_OUT_WIRED_HEADPHONE;
-    headset_on = ((adev->out_device & AUDIO_DEVICE_OUT_WIRED_HEADSET) |
-                 (adev->in_device & AUDIO_DEVICE_IN_WIRED_HEADSET));
-    speaker_on = adev->out_device & AUDIO_DEVICE_OUT_SPEAKER;
-    docked = adev->out_device & AUDIO_DEVICE_OUT_ANLG_DOCK_HEADSET;
-    hdmi_on = adev->out_device & AUDIO_DEVICE_OUT_AUX_DIGITAL;
-    usb_out_on = adev->out_device & AUDIO_DEVICE_OUT_USB_DEVICE;
-    usb_in_on = adev->in_device & AUDIO_DEVICE_IN_USB_DEVICE;
-    main_mic_on = adev->in_device & AUDIO_DEVICE_IN_BUILTIN_MIC;
-
-    reset_mixer_state(adev->ar);
+    int old_usb_slot;
+    const char *paths[6];
+    unsigned int num_paths = 0;
+
+    headphone_on = state->out_device & AUDIO_DEVICE_OUT_WIRED_HEADPHONE;
+    headset_on = ((state->out_device & AUDIO_DEVICE_OUT_WIRED_HEADSET) |
+                 (state->in_device & AUDIO_DEVICE_IN_WIRED_HEADSET));
+    speaker_on = state->out_device & AUDIO_DEVICE_OUT_SPEAKER;
+    docked = state->out_device & AUDIO_DEVICE_OUT_ANLG_DOCK_HEADSET;
+    hdmi_on = state->out_device & AUDIO_DEVICE_OUT_AUX_DIGITAL;
+    usb_out_on = state->out_device & AUDIO_DEVICE_OUT_USB_DEVICE;
+    usb_in_on = state->in_device & AUDIO_DEVICE_IN_USB_DEVICE;
+    main_mic_on = state->in_device & AUDIO_DEVICE_IN_BUILTIN_MIC;
 
     if (headphone_on || headset_on) {
-        audio_route_apply_path(adev->ar, "headphone");
-        adev->card_out_index = AUDIO_CARD_PCH;
+        paths[num_paths++] = "headphone";
+        state->card_out_index = AUDIO_CARD_PCH;
     }
     if (speaker_on) {
-        audio_route_apply_path(adev->ar, "speaker");
-        adev->card_out_index = AUDIO_CARD_PCH;
+        paths[num_paths++] = "speaker";
+        state->card_out_index = AUDIO_CARD_PCH;
     }
     if (docked) {
-        audio_route_apply_path(adev->ar, "dock");
-        adev->card_out_index = AUDIO_CARD_PCH;
+        paths[num_paths++] = "dock";
+        state->card_out_index = AUDIO_CARD_PCH;
     }
     if (hdmi_on) {
-        audio_route_apply_path(adev->ar, "hdmi");
-        adev->card_out_index = AUDIO_CARD_HDMI;
+        paths[num_paths++] = "hdmi";
+        state->card_out_index = AUDIO_CARD_HDMI;
     }
     if (usb_out_on || usb_in_on) {
-        find_usb_card_slot(adev);
-        audio_route_apply_path(adev->ar, "usb");
+        /* the USB card may have been removed, inserted or re-inserted */
+        old_usb_slot = state->usb_slot;
+        state->usb_slot = find_usb_card_slot(state->cards, state->pch_slot,
+                                             state->hdmi_slot);
+
+        /* the card has moved or gone, don't keep its control mixer open */
+        if (old_usb_slot != CARD_SLOT_NOT_FOUND &&
+                old_usb_slot != state->usb_slot)
+            audio_route_control_release((unsigned int)old_usb_slot);
+
+        paths[num_paths++] = "usb";
         if (usb_out_on) {
-            adev->card_out_index = AUDIO_CARD_USB;
+            state->card_out_index = AUDIO_CARD_USB;
         }
         if (usb_in_on) {
-            adev->card_in_index = AUDIO_CARD_USB;
-            audio_route_control_set_number((unsigned int)
-                  adev->card[adev->card_in_index].card_slot,
-                  USB_MIC_CAPTURE_SWITCH_STR, USB_MIC_CAPTURE_SWITCH_ON);
-            audio_route_control_set_number((unsigned int)
-                  adev->card[adev->card_in_index].card_slot,
-                  USB_MIC_CAPTURE_VOLUME_STR, USB_MIC_CAPTURE_VOLUME_DEFAULT);
+            state->card_in_index = AUDIO_CARD_USB;
+            if (state->usb_slot != CARD_SLOT_NOT_FOUND)
+                audio_route_control_set_batch((unsigned int)state->usb_slot,
+                      usb_mic_controls,
+                      sizeof(usb_mic_controls) / sizeof(usb_mic_controls[0]));
         }
     }
     if (main_mic_on || headset_on) {
-        if (adev->orientation == ORIENTATION_LANDSCAPE)
-            audio_route_apply_path(adev->ar, "main-mic-left");
+        if (state->orientation == ORIENTATION_LANDSCAPE)
+            paths[num_paths++] = "main-mic-left";
+        else
+            paths[num_paths++] = "main-mic-top";
+        state->card_in_index = AUDIO_CARD_PCH;
+
+        /* a headset mic is mono on the left channel, the built in mics
+           are a pair */
+        if (state->in_device & AUDIO_DEVICE_IN_WIRED_HEADSET)
+            state->in_downmix = DOWNMIX_DISCARD_RIGHT;
         else
-            audio_route_apply_path(adev->ar, "main-mic-top");
-        adev->card_in_index = AUDIO_CARD_PCH;
+            state->in_downmix = DOWNMIX_AVERAGE;
     }
 
-    update_mixer_state(adev->ar);
+    /* the same few device combinations come back all the time, so the
+       mixer changes between them are memoized by audio_route */
+    audio_route_apply_route(state->ar, paths, num_paths);
 
     ALOGV("hp=%c speaker=%c dock=%c hdmi=%c",
       headphone_on ? 'y' : 'n',
@@ -457,41 +680,119 @@ static void select_devices(struct audio_device *adev) {
       main_mic_on ? 'y' : 'n');
 }
 
+static void *route_thread_loop(void *context)
+{
+    struct audio_device *adev = (struct audio_device *)context;
+    struct route_state state;
+    unsigned int seq;
+    int64_t start_us;
+
+    pthread_mutex_lock(&adev->lock);
+    for (;;) {
+        while (adev->route_done_seq == adev->route_seq && !adev->route_exit)
+            pthread_cond_wait(&adev->route_cond, &adev->lock);
+        if (adev->route_exit)
+            break;
+
+        /* everything requested so far is covered by this snapshot */
+        seq = adev->route_seq;
+        state.ar = adev->ar;
+        state.cards = adev->cards;
+        state.out_device = adev->out_device;
+        state.in_device = adev->in_device;
+        state.orientation = adev->orientation;
+        state.pch_slot = adev->card[AUDIO_CARD_PCH].card_slot;
+        state.hdmi_slot = adev->card[AUDIO_CARD_HDMI].card_slot;
+        state.usb_slot = adev->card[AUDIO_CARD_USB].card_slot;
+        state.card_out_index = adev->card_out_index;
+        state.card_in_index = adev->card_in_index;
+        state.in_downmix = adev->in_downmix;
+        pthread_mutex_unlock(&adev->lock);
+
+        /* the mixer ioctls and card scans run without the device mutex */
+        start_us = stats_now_us();
+        route_devices(&state);
+        stats_hist_add_since(&adev->stats.route_us, start_us);
+
+        pthread_mutex_lock(&adev->lock);
+        adev->card[AUDIO_CARD_USB].card_slot = state.usb_slot;
+        adev->card[AUDIO_CARD_USB].device = USB_DEVICE;
+        adev->card_out_index = state.card_out_index;
+        adev->card_in_index = state.card_in_index;
+        adev->in_downmix = state.in_downmix;
+        dev_state_publish(adev);
+        adev->route_done_seq = seq;
+        pthread_cond_broadcast(&adev->route_done_cond);
+    }
+    pthread_mutex_unlock(&adev->lock);
+
+    return NULL;
+}
+
+/*
+ * Queues routing of the current devices to route_thread.
+ * must be called with hw device mutex locked
+ */
+static void select_devices(struct audio_device *adev) {
+    int ret;
+
+    ret =  init_cards_and_route(adev, true);
+    if (ret < 0){
+        return;
+    }
+
+    adev->route_seq++;
+    pthread_cond_signal(&adev->route_cond);
+    stats_inc(&adev->stats.select_devices);
+}
+
+/*
+ * Waits for route_thread to catch up with the routing requests, so that the
+ * card indices match the devices.
+ * must be called with hw device mutex locked
+ */
+static void wait_for_route(struct audio_device *adev)
+{
+    while (adev->route_done_seq != adev->route_seq && !adev->route_exit)
+        pthread_cond_wait(&adev->route_done_cond, &adev->lock);
+}
+
 /* must be called with hw device and output stream mutexes locked */
 static void do_out_standby(struct stream_out *out)
 {
     struct audio_device *adev = out->dev;
 
     if (!out->standby) {
+        stats_inc(&out->stats.standby);
         pcm_close(out->pcm);
         out->pcm = NULL;
         adev->active_out = NULL;
         if (out->resampler) {
-            release_resampler(out->resampler);
+            poly_resampler_release(out->resampler);
             out->resampler = NULL;
         }
         if (out->buffer) {
             free(out->buffer);
             out->buffer = NULL;
         }
+        free(out->convert_buffer);
+        out->convert_buffer = NULL;
+        out->convert_size = 0;
         out->standby = true;
     }
 }
 
-static int select_card(int card, unsigned int device, int d)
+static int select_card(struct audio_device *adev, int card,
+                       unsigned int device, int d)
 {
-    int i;
-    char dname[32];
-
     if (card == CARD_SLOT_NOT_FOUND) {
         ALOGE("no pcm card found!");
         return(-1);
     }
 
-    snprintf(dname, sizeof(dname), "/dev/snd/pcmC%dD%d%c", card, device,
-      (d == PCM_IN) ? 'c' : 'p');
-    if (!access(dname, R_OK | W_OK)) {
-        ALOGD("found %s %s", (d == PCM_IN) ? "in" : "out", dname);
+    if (card_registry_has_pcm(adev->cards, card, device, d == PCM_IN)) {
+        ALOGD("found %s pcmC%dD%u%c", (d == PCM_IN) ? "in" : "out", card,
+              device, (d == PCM_IN) ? 'c' : 'p');
         return(card);
     }
     ALOGE("no pcm card found!");
@@ -504,31 +805,165 @@ static void do_in_standby(struct stream_in *in)
     struct audio_device *adev = in->dev;
 
     if (!in->standby) {
+        stats_inc(&in->stats.standby);
         pcm_close(in->pcm);
         in->pcm = NULL;
         adev->active_in = NULL;
+        dev_state_publish(adev);
         if (in->resampler) {
-            release_resampler(in->resampler);
+            poly_resampler_release(in->resampler);
             in->resampler = NULL;
         }
         if (in->buffer) {
             free(in->buffer);
             in->buffer = NULL;
         }
+        free(in->convert_buffer);
+        in->convert_buffer = NULL;
+        in->convert_size = 0;
         in->standby = true;
     }
 }
 
+/* true if two pcms can be open at these rates at once, see below */
+static bool rates_compatible(unsigned int rate, unsigned int other_rate)
+{
+    return !(((rate % 8000 == 0) && (other_rate % 8000) != 0) ||
+             ((rate % 11025 == 0) && (other_rate % 11025) != 0));
+}
+
+/*
+ * Returns rate if the pcm device supports it, so that no resampling is
+ * needed, otherwise the default rate, or failing that the supported rate
+ * closest to it.
+ */
+static unsigned int pcm_pick_rate(unsigned int card, unsigned int device,
+                                  unsigned int flags, unsigned int rate,
+                                  unsigned int default_rate)
+{
+    struct pcm_params *params;
+    unsigned int min, max;
+
+    params = pcm_params_get(card, device, flags);
+    if (!params)
+        return default_rate;
+    min = pcm_params_get_min(params, PCM_PARAM_RATE);
+    max = pcm_params_get_max(params, PCM_PARAM_RATE);
+    pcm_params_free(params);
+
+    if (rate >= min && rate <= max)
+        return rate;
+    if (default_rate >= min && default_rate <= max)
+        return default_rate;
+    return default_rate < min ? min : max;
+}
+
+/* copies a pcm config to run at rate, with periods of the same duration */
+static void pcm_config_at_rate(struct pcm_config *config,
+                               const struct pcm_config *template,
+                               unsigned int rate)
+{
+    *config = *template;
+    if (rate == template->rate)
+        return;
+
+    /* a multiple of 16 frames, like the buffers of audioflinger */
+    config->rate = rate;
+    config->period_size = ((template->period_size * rate / template->rate)
+                                + 15) & ~15;
+    if (template->start_threshold > 1)
+        config->start_threshold = template->start_threshold *
+                config->period_size / template->period_size;
+    if (template->stop_threshold)
+        config->stop_threshold = config->period_size * config->period_count;
+}
+
+/* sample format of a stream format, false if it is not supported */
+static bool sample_format_of(audio_format_t format,
+                             enum sample_format *sample_format)
+{
+    switch (format) {
+    case AUDIO_FORMAT_PCM_16_BIT:
+        *sample_format = SAMPLE_FORMAT_S16;
+        return true;
+    case AUDIO_FORMAT_PCM_8_24_BIT:
+        *sample_format = SAMPLE_FORMAT_S24;
+        return true;
+    case AUDIO_FORMAT_PCM_32_BIT:
+        *sample_format = SAMPLE_FORMAT_S32;
+        return true;
+    default:
+        return false;
+    }
+}
+
+static enum sample_format pcm_sample_format(enum pcm_format format)
+{
+    switch (format) {
+    case PCM_FORMAT_S24_LE:
+        return SAMPLE_FORMAT_S24;
+    case PCM_FORMAT_S32_LE:
+        return SAMPLE_FORMAT_S32;
+    case PCM_FORMAT_S16_LE:
+    default:
+        return SAMPLE_FORMAT_S16;
+    }
+}
+
+/*
+ * Returns the pcm format matching samples wider than S16 if the pcm
+ * device supports it, otherwise the other wide format, or failing that
+ * PCM_FORMAT_S16_LE.
+ */
+static enum pcm_format pcm_pick_format(unsigned int card, unsigned int device,
+                                       unsigned int flags,
+                                       enum sample_format format)
+{
+    static const struct {
+        enum pcm_format format;
+        unsigned int alsa_format;
+    } wide[] = {
+        { PCM_FORMAT_S24_LE, SNDRV_PCM_FORMAT_S24_LE },
+        { PCM_FORMAT_S32_LE, SNDRV_PCM_FORMAT_S32_LE },
+    };
+    enum pcm_format picked = PCM_FORMAT_S16_LE;
+    struct pcm_params *params;
+    struct pcm_mask *mask;
+    unsigned int i, first, bit, bits;
+
+    if (format == SAMPLE_FORMAT_S16)
+        return PCM_FORMAT_S16_LE;
+    params = pcm_params_get(card, device, flags);
+    if (!params)
+        return PCM_FORMAT_S16_LE;
+
+    mask = pcm_params_get_mask(params, PCM_PARAM_FORMAT);
+    bits = mask ? sizeof(mask->bits[0]) * 8 : 0;
+    first = format == SAMPLE_FORMAT_S24 ? 0 : 1;
+    for (i = 0; mask && i < 2; i++) {
+        bit = wide[(first + i) % 2].alsa_format;
+        if (mask->bits[bit / bits] & (1U << (bit % bits))) {
+            picked = wide[(first + i) % 2].format;
+            break;
+        }
+    }
+    pcm_params_free(params);
+
+    return picked;
+}
+
 /* must be called with hw device and output stream mutexes locked */
 static int start_output_stream(struct stream_out *out)
 {
     struct audio_device *adev = out->dev;
     int card;
     unsigned int device;
+    unsigned int rate;
     int ret;
     ret =  init_cards_and_route(adev, true);
     if (ret < 0)
         return ret;
+    wait_for_route(adev);
 
     /*
      * Due to the lack of sample rate converters in the SoC,
@@ -541,10 +976,33 @@ static int start_output_stream(struct stream_out *out)
     } else {
         card = adev->card[adev->card_out_index].card_slot;
         device = adev->card[adev->card_out_index].device;
-        out->pcm_config = &pcm_config_out;
         out->buffer_type = OUT_BUFFER_TYPE_UNKNOWN;
     }
 
+    /*
+     * Open the pcm at the stream rate when the card supports it, unless
+     * that would put a running input into standby.
+     */
+    rate = pcm_pick_rate(card, device, PCM_OUT, out->sample_rate,
+                         out->profile_config->rate);
+    if (adev->active_in &&
+            !rates_compatible(rate, adev->active_in->pcm_config->rate))
+        rate = out->profile_config->rate;
+    pcm_config_at_rate(&out->config, out->profile_config, rate);
+    out->pcm_config = &out->config;
+
+    /*
+     * Samples wider than S16 go to the card as they are when it takes
+     * them, unless they need resampling, downmixing or an mmap pcm, which
+     * only handle S16.
+     */
+    if (rate == out->sample_rate && !adev->out_mmap &&
+            popcount(out_get_channels(&out->stream.common)) <=
+                (int)out->config.channels)
+        out->config.format = pcm_pick_format(card, device, PCM_OUT,
+                                             out->sample_format);
+    out->pcm_sample_format = pcm_sample_format(out->config.format);
+
     /*
      * All open PCMs can only use a single group of rates at once:
      * Group 1: 11.025, 22.05, 44.1
@@ -555,19 +1013,51 @@ static int start_output_stream(struct stream_out *out)
     if (adev->active_in) {
         struct stream_in *in = adev->active_in;
         pthread_mutex_lock(&in->lock);
-        if (((out->pcm_config->rate % 8000 == 0) &&
-                 (in->pcm_config->rate % 8000) != 0) ||
-                 ((out->pcm_config->rate % 11025 == 0) &&
-                 (in->pcm_config->rate % 11025) != 0))
+        if (!rates_compatible(out->pcm_config->rate, in->pcm_config->rate))
             do_in_standby(in);
         pthread_mutex_unlock(&in->lock);
     }
 
-    ret = select_card(card, device, PCM_OUT);
+    ret = select_card(adev, card, device, PCM_OUT);
     if (ret < 0) {
         return -ENODEV;
     }
-    out->pcm = pcm_open(card, device, PCM_OUT | PCM_NORESTART, out->pcm_config);
+    /* monotonic timestamps are needed to arm the pacing timer from them */
+    out->mmap = adev->out_mmap;
+    out->mmap_running = false;
+    if (out->mmap) {
+        out->pcm = pcm_open(card, device,
+                            PCM_OUT | PCM_NORESTART | PCM_MONOTONIC | PCM_MMAP,
+                            out->pcm_config);
+        if (!pcm_is_ready(out->pcm)) {
+            ALOGW("pcm_open(out) mmap failed: %s, using pcm_write()",
+                  pcm_get_error(out->pcm));
+            pcm_close(out->pcm);
+            out->mmap = false;
+        }
+    }
+    if (!out->mmap)
+        out->pcm = pcm_open(card, device,
+                            PCM_OUT | PCM_NORESTART | PCM_MONOTONIC,
+                            out->pcm_config);
+
+    /*
+     * The rate range of the card may have holes, fall back to the
+     * rate of the profile before giving up.
+     */
+    if (out->pcm && !pcm_is_ready(out->pcm) &&
+            out->config.rate != out->profile_config->rate) {
+        ALOGW("pcm_open(out) at %u Hz failed: %s, trying %u Hz",
+              out->config.rate, pcm_get_error(out->pcm),
+              out->profile_config->rate);
+        pcm_close(out->pcm);
+        pcm_config_at_rate(&out->config, out->profile_config,
+                           out->profile_config->rate);
+        out->pcm_sample_format = pcm_sample_format(out->config.format);
+        out->pcm = pcm_open(card, device,
+                            PCM_OUT | PCM_NORESTART | PCM_MONOTONIC,
+                            out->pcm_config);
+    }
 
     if (out->pcm && !pcm_is_ready(out->pcm)) {
         ALOGE("pcm_open(out) failed: %s", pcm_get_error(out->pcm));
@@ -580,13 +1070,14 @@ static int start_output_stream(struct stream_out *out)
      * create a resampler.
      */
     if (out_get_sample_rate(&out->stream.common) != out->pcm_config->rate) {
-        ret = create_resampler(out_get_sample_rate(&out->stream.common),
-                               out->pcm_config->rate,
-                               out->pcm_config->channels,
-                               RESAMPLER_QUALITY_DEFAULT,
-                               NULL,
-                               &out->resampler);
-        out->buffer_frames = (pcm_config_out.period_size * out->pcm_config->rate) /
+        ret = poly_resampler_create(out_get_sample_rate(&out->stream.common),
+                                    out->pcm_config->rate,
+                                    out->pcm_config->channels,
+                                    OUT_RESAMPLER_QUALITY,
+                                    NULL,
+                                    &out->resampler);
+        out->buffer_frames = (out->profile_config->period_size *
+                              out->pcm_config->rate) /
                 out_get_sample_rate(&out->stream.common) + 1;
 
         out->buffer = malloc(pcm_frames_to_bytes(out->pcm, out->buffer_frames));
@@ -601,13 +1092,16 @@ static int start_output_stream(struct stream_out *out)
 static int start_input_stream(struct stream_in *in)
 {
     struct audio_device *adev = in->dev;
+    const struct pcm_config *template;
     int card;
     unsigned int device;
+    unsigned int rate;
     int ret;
 
     ret =  init_cards_and_route(adev, true);
     if (ret < 0)
         return ret;
+    wait_for_route(adev);
 
     /*
      * Due to the lack of sample rate converters in the SoC,
@@ -620,12 +1114,24 @@ static int start_input_stream(struct stream_in *in)
         card = adev->card[adev->card_in_index].card_slot;
         device = adev->card[adev->card_in_index].device;
         if (adev->in_device & AUDIO_DEVICE_IN_USB_DEVICE) {
-            in->pcm_config = &pcm_config_usb_in;
+            template = &pcm_config_usb_in;
         } else {
-            in->pcm_config = &pcm_config_in;
+            template = &pcm_config_in;
         }
     }
 
+    /*
+     * Capture at the requested rate when the card supports it, unless
+     * that would put a running output into standby.
+     */
+    rate = pcm_pick_rate(card, device, PCM_IN, in->requested_rate,
+                         template->rate);
+    if (adev->active_out &&
+            !rates_compatible(rate, adev->active_out->pcm_config->rate))
+        rate = template->rate;
+    pcm_config_at_rate(&in->config, template, rate);
+    in->pcm_config = &in->config;
+
     /*
      * All open PCMs can only use a single group of rates at once:
      * Group 1: 11.025, 22.05, 44.1
@@ -636,19 +1142,40 @@ static int start_input_stream(struct stream_in *in)
     if (adev->active_out) {
         struct stream_out *out = adev->active_out;
         pthread_mutex_lock(&out->lock);
-        if (((in->pcm_config->rate % 8000 == 0) &&
-                 (out->pcm_config->rate % 8000) != 0) ||
-                 ((in->pcm_config->rate % 11025 == 0) &&
-                 (out->pcm_config->rate % 11025) != 0))
+        if (!rates_compatible(in->pcm_config->rate, out->pcm_config->rate))
             do_out_standby(out);
         pthread_mutex_unlock(&out->lock);
     }
 
-    ret = select_card(card, device, PCM_IN);
+    ret = select_card(adev, card, device, PCM_IN);
     if (ret < 0) {
         return -ENODEV;
     }
-    in->pcm = pcm_open(card, device, PCM_IN, in->pcm_config);
+    in->mmap = adev->in_mmap;
+    if (in->mmap) {
+        in->pcm = pcm_open(card, device, PCM_IN | PCM_MONOTONIC | PCM_MMAP,
+                           in->pcm_config);
+        if (!pcm_is_ready(in->pcm) || pcm_start(in->pcm) < 0) {
+            ALOGW("pcm_open(in) mmap failed: %s, using pcm_read()",
+                  pcm_get_error(in->pcm));
+            pcm_close(in->pcm);
+            in->mmap = false;
+        }
+    }
+    if (!in->mmap)
+        in->pcm = pcm_open(card, device, PCM_IN | PCM_MONOTONIC,
+                           in->pcm_config);
+
+    /* as for the output, the rate range of the card may have holes */
+    if (in->pcm && !pcm_is_ready(in->pcm) &&
+            in->config.rate != template->rate) {
+        ALOGW("pcm_open(in) at %u Hz failed: %s, trying %u Hz",
+              in->config.rate, pcm_get_error(in->pcm), template->rate);
+        pcm_close(in->pcm);
+        pcm_config_at_rate(&in->config, template, template->rate);
+        in->pcm = pcm_open(card, device, PCM_IN | PCM_MONOTONIC,
+                           in->pcm_config);
+    }
 
     if (in->pcm && !pcm_is_ready(in->pcm)) {
         ALOGE("pcm_open(in) failed: %s", pcm_get_error(in->pcm));
@@ -664,19 +1191,126 @@ static int start_input_stream(struct stream_in *in)
         in->buf_provider.get_next_buffer = get_next_buffer;
         in->buf_provider.release_buffer = release_buffer;
 
-        ret = create_resampler(in->pcm_config->rate,
-                               in_get_sample_rate(&in->stream.common),
-                               1,
-                               RESAMPLER_QUALITY_DEFAULT,
-                               &in->buf_provider,
-                               &in->resampler);
+        ret = poly_resampler_create(in->pcm_config->rate,
+                                    in_get_sample_rate(&in->stream.common),
+                                    1,
+                                    in->requested_rate <= IN_VOICE_MAX_RATE ?
+                                            IN_VOICE_RESAMPLER_QUALITY :
+                                            IN_RESAMPLER_QUALITY,
+                                    &in->buf_provider,
+                                    &in->resampler);
     }
     in->buffer_size = pcm_frames_to_bytes(in->pcm,
                                           in->pcm_config->period_size);
     in->buffer = malloc(in->buffer_size);
     in->frames_in = 0;
+    in->mmap_frames = 0;
+    in->pcm_frames = 0;
+    in->check_ns = 0;
 
     adev->active_in = in;
+    dev_state_publish(adev);
+
+    return 0;
+}
+
+/* must be called with input stream mutex locked */
+static void in_count_lost(struct stream_in *in, uint64_t frames)
+{
+    if (frames > UINT32_MAX - in->frames_lost)
+        in->frames_lost = UINT32_MAX;
+    else
+        in->frames_lost += frames;
+}
+
+/*
+ * Counts the frames consumed from the pcm, and checks how far the hardware
+ * pointer moved against the time between its timestamps. The frames of an
+ * overrun, dropped by the driver and restarted over by tinyalsa, show up as
+ * time that the pointer did not follow. Comparing each check with the
+ * previous one only, the card clock cannot drift into false losses.
+ * must be called with input stream mutex locked
+ */
+static void in_account_frames(struct stream_in *in, unsigned int frames)
+{
+    struct timespec time_stamp;
+    unsigned int avail;
+    uint64_t hw_frames;
+    int64_t ns, lost;
+
+    in->pcm_frames += frames;
+    if (pcm_get_htimestamp(in->pcm, &avail, &time_stamp) < 0)
+        return;
+    hw_frames = in->pcm_frames + avail;
+    ns = timespec_to_ns(&time_stamp);
+
+    if (in->check_ns) {
+        lost = (ns - in->check_ns) * in->pcm_config->rate / NSEC_PER_SEC -
+                (int64_t)(hw_frames - in->check_frames);
+        /* less than a period is the granularity of the pointer */
+        if (lost > (int64_t)in->pcm_config->period_size) {
+            lost = lost * in_get_sample_rate(&in->stream.common) /
+                    in->pcm_config->rate;
+            ALOGW("in_read() overrun, %lld frames lost", (long long)lost);
+            stats_inc(&in->stats.overruns);
+            in->frames_dropped += lost;
+            in_count_lost(in, lost);
+        }
+    }
+    in->check_ns = ns;
+    in->check_frames = hw_frames;
+}
+
+/* must be called with input stream mutex locked */
+static int in_mmap_xrun(struct stream_in *in)
+{
+    ALOGW("in_read() mmap overrun");
+    stats_inc(&in->stats.overruns);
+    pcm_prepare(in->pcm);
+    pcm_start(in->pcm);
+    return -EPIPE;
+}
+
+/*
+ * Maps up to a period of captured frames, straight from the hardware
+ * pointer, for get_next_buffer() to hand out. Stereo frames are downmixed
+ * in place.
+ * must be called with input stream mutex locked
+ */
+static int in_mmap_acquire(struct stream_in *in)
+{
+    unsigned int buffer_size = pcm_get_buffer_size(in->pcm);
+    unsigned int frames;
+    void *areas;
+    int avail;
+    int64_t start_us = stats_now_us();
+
+    for (;;) {
+        avail = pcm_mmap_avail(in->pcm);
+        if (avail < 0 || (unsigned int)avail > buffer_size)
+            return in_mmap_xrun(in);
+        if (avail > 0)
+            break;
+        if (pcm_wait(in->pcm, (buffer_size * 1000) /
+                                  in->pcm_config->rate + 1) < 0)
+            return in_mmap_xrun(in);
+    }
+    stats_hist_add_since(&in->stats.pcm_read_us, start_us);
+
+    frames = avail;
+    if (frames > in->pcm_config->period_size)
+        frames = in->pcm_config->period_size;
+    if (pcm_mmap_begin(in->pcm, &areas, &in->mmap_offset, &frames) < 0)
+        return in_mmap_xrun(in);
+
+    in->mmap_area = (int16_t *)((char *)areas +
+                        pcm_frames_to_bytes(in->pcm, in->mmap_offset));
+    in->mmap_frames = frames;
+    in->frames_in = frames;
+
+    if (in->pcm_config->channels == 2)
+        downmix_stereo_to_mono(in->mmap_area, in->mmap_area, frames,
+                               in->downmix);
 
     return 0;
 }
@@ -699,10 +1333,29 @@ static int get_next_buffer(struct resampler_buffer_provider *buffer_provider,
         return -ENODEV;
     }
 
+    if (in->mmap) {
+        if (in->frames_in == 0) {
+            in->read_status = in_mmap_acquire(in);
+            if (in->read_status != 0) {
+                buffer->raw = NULL;
+                buffer->frame_count = 0;
+                return in->read_status;
+            }
+        }
+
+        buffer->frame_count = (buffer->frame_count > in->frames_in) ?
+                                    in->frames_in : buffer->frame_count;
+        buffer->i16 = in->mmap_area + (in->mmap_frames - in->frames_in);
+        return in->read_status;
+    }
+
     if (in->frames_in == 0) {
+        int64_t start_us = stats_now_us();
+
         in->read_status = pcm_read(in->pcm,
                                    (void*)in->buffer,
                                    in->buffer_size);
+        stats_hist_add_since(&in->stats.pcm_read_us, start_us);
         if (in->read_status != 0) {
             ALOGE("get_next_buffer() pcm_read error %d", in->read_status);
             buffer->raw = NULL;
@@ -710,13 +1363,10 @@ static int get_next_buffer(struct resampler_buffer_provider *buffer_provider,
             return in->read_status;
         }
         in->frames_in = in->pcm_config->period_size;
-        if (in->pcm_config->channels == 2) {
-            unsigned int i;
-
-            /* Discard right channel */
-            for (i = 1; i < in->frames_in; i++)
-                in->buffer[i] = in->buffer[i * 2];
-        }
+        in_account_frames(in, in->frames_in);
+        if (in->pcm_config->channels == 2)
+            downmix_stereo_to_mono(in->buffer, in->buffer, in->frames_in,
+                                   in->downmix);
     }
 
     buffer->frame_count = (buffer->frame_count > in->frames_in) ?
@@ -739,20 +1389,30 @@ static void release_buffer(struct resampler_buffer_provider *buffer_provider,
                                    offsetof(struct stream_in, buf_provider));
 
     in->frames_in -= buffer->frame_count;
+
+    /* hand the mapped frames back to the driver once all have been used */
+    if (in->mmap && in->mmap_frames && in->frames_in == 0) {
+        if (pcm_mmap_commit(in->pcm, in->mmap_offset, in->mmap_frames) < 0)
+            in->read_status = in_mmap_xrun(in);
+        else
+            in_account_frames(in, in->mmap_frames);
+        in->mmap_frames = 0;
+    }
 }
 
 /* read_frames() reads frames from kernel driver, down samples to capture rate
  * if necessary and output the number of frames requested to the buffer specified */
 static ssize_t read_frames(struct stream_in *in, void *buffer, ssize_t frames)
 {
+    /* mono S16, whatever the stream format */
+    const size_t frame_size = sizeof(int16_t);
     ssize_t frames_wr = 0;
 
     while (frames_wr < frames) {
         size_t frames_rd = frames - frames_wr;
         if (in->resampler != NULL) {
             in->resampler->resample_from_provider(in->resampler,
-                    (int16_t *)((char *)buffer +
-                            frames_wr * audio_stream_frame_size(&in->stream.common)),
+                    (int16_t *)((char *)buffer + frames_wr * frame_size),
                     &frames_rd);
         } else {
             struct resampler_buffer buf = {
@@ -761,10 +1421,9 @@ static ssize_t read_frames(struct stream_in *in, void *buffer, ssize_t frames)
             };
             get_next_buffer(&in->buf_provider, &buf);
             if (buf.raw != NULL) {
-                memcpy((char *)buffer +
-                           frames_wr * audio_stream_frame_size(&in->stream.common),
+                memcpy((char *)buffer + frames_wr * frame_size,
                         buf.raw,
-                        buf.frame_count * audio_stream_frame_size(&in->stream.common));
+                        buf.frame_count * frame_size);
                 frames_rd = buf.frame_count;
             }
             release_buffer(&in->buf_provider, &buf);
@@ -783,7 +1442,9 @@ static ssize_t read_frames(struct stream_in *in, void *buffer, ssize_t frames)
 
 static uint32_t out_get_sample_rate(const struct audio_stream *stream)
 {
-    return pcm_config_out.rate;
+    struct stream_out *out = (struct stream_out *)stream;
+
+    return out->sample_rate;
 }
 
 static int out_set_sample_rate(struct audio_stream *stream, uint32_t rate)
@@ -793,7 +1454,9 @@ static int out_set_sample_rate(struct audio_stream *stream, uint32_t rate)
 
 static size_t out_get_buffer_size(const struct audio_stream *stream)
 {
-    return pcm_config_out.period_size *
+    struct stream_out *out = (struct stream_out *)stream;
+
+    return out->profile_config->period_size *
                audio_stream_frame_size((struct audio_stream *)stream);
 }
 
@@ -804,7 +1467,9 @@ static uint32_t out_get_channels(const struct audio_stream *stream)
 
 static audio_format_t out_get_format(const struct audio_stream *stream)
 {
-    return AUDIO_FORMAT_PCM_16_BIT;
+    struct stream_out *out = (struct stream_out *)stream;
+
+    return out->format;
 }
 
 static int out_set_format(struct audio_stream *stream, audio_format_t format)
@@ -827,6 +1492,22 @@ static int out_standby(struct audio_stream *stream)
 
 static int out_dump(const struct audio_stream *stream, int fd)
 {
+    struct stream_out *out = (struct stream_out *)stream;
+    struct out_stats *stats = &out->stats;
+
+    stats_print(fd, " output %p: %u Hz, format %#x, profile %d%s\n", out,
+                out->sample_rate, out->format, out->profile,
+                out->ring ? ", mixed" : "");
+    stats_print_hist(fd, "write", "us", &stats->write_us);
+    stats_print_hist(fd, "pace", "us", &stats->pace_us);
+    stats_print_hist(fd, "pcm_write", "us", &stats->pcm_write_us);
+    stats_print_hist(fd, "kernel_frames", "frames", &stats->kernel_frames);
+    stats_print_count(fd, "underruns", &stats->underruns);
+    stats_print_hist(fd, "underrun_boost", "frames", &stats->underrun_boost);
+    stats_print_count(fd, "prefill_frames", &stats->prefill_frames);
+    stats_print_count(fd, "standby", &stats->standby);
+    stats_print_count(fd, "resume", &stats->resume);
+
     return 0;
 }
 
@@ -834,6 +1515,7 @@ static int out_set_parameters(struct audio_stream *stream, const char *kvpairs)
 {
     struct stream_out *out = (struct stream_out *)stream;
     struct audio_device *adev = out->dev;
+    struct stream_out *pcm_out = out->ring ? adev->mixer_out : out;
     struct str_parms *parms;
     char value[32];
     int ret;
@@ -853,47 +1535,419 @@ static int out_set_parameters(struct audio_stream *stream, const char *kvpairs)
              *   device is USB, which may have been removed, inserted,
              *   or re-inserted.
              */
-            pthread_mutex_lock(&out->lock);
-            do_out_standby(out);
-            pthread_mutex_unlock(&out->lock);
+            pthread_mutex_lock(&pcm_out->lock);
+            do_out_standby(pcm_out);
+            pthread_mutex_unlock(&pcm_out->lock);
 
             adev->out_device = val;
+            dev_state_publish(adev);
             select_devices(adev);
         }
     }
-    pthread_mutex_unlock(&adev->lock);
+    pthread_mutex_unlock(&adev->lock);
+
+    str_parms_destroy(parms);
+    return ret;
+}
+
+static char * out_get_parameters(const struct audio_stream *stream, const char *keys)
+{
+    return strdup("");
+}
+
+/* periods out_write() keeps queued in the pcm for a buffer type */
+static size_t out_queued_periods(const struct stream_out *out,
+                                 int buffer_type)
+{
+    switch (out->profile) {
+    case OUT_PROFILE_FAST:
+        return OUT_FAST_QUEUED_PERIODS;
+    case OUT_PROFILE_DEEP_BUFFER:
+        return OUT_DEEP_QUEUED_PERIODS;
+    case OUT_PROFILE_PRIMARY:
+    default:
+        return buffer_type == OUT_BUFFER_TYPE_LONG ? OUT_LONG_PERIOD_COUNT :
+                                                     OUT_SHORT_PERIOD_COUNT;
+    }
+}
+
+static uint32_t out_get_latency(const struct audio_stream_out *stream)
+{
+    struct stream_out *out = (struct stream_out *)stream;
+    struct audio_device *adev = out->dev;
+    const struct pcm_config *config = out->profile_config;
+    struct dev_state state;
+    size_t period_count;
+
+    dev_state_read(adev, &state);
+    if (state.screen_off && !state.in_active &&
+            !(state.out_device & AUDIO_DEVICE_OUT_ALL_SCO))
+        period_count = out_queued_periods(out, OUT_BUFFER_TYPE_LONG);
+    else
+        period_count = out_queued_periods(out, OUT_BUFFER_TYPE_SHORT);
+
+    /* frames queued to the mixer wait in the ring first */
+    if (out->ring)
+        period_count += OUT_MIXER_RING_PERIODS;
+
+    return (config->period_size * period_count * 1000) / config->rate;
+}
+
+static int out_set_volume(struct audio_stream_out *stream, float left,
+                          float right)
+{
+    return -ENOSYS;
+}
+
+/*
+ * Waits until no more than cur_write_threshold frames are queued in the
+ * kernel pcm driver buffer, and returns the number of frames queued.
+ * The time the threshold is reached is computed from the timestamp of the
+ * last hardware pointer update, and the pacing timer is armed for exactly
+ * that time, so a write usually wakes up once.
+ * must be called with output stream mutex locked
+ */
+static int out_pace_write(struct stream_out *out)
+{
+    struct timespec time_stamp;
+    struct timespec now;
+    struct itimerspec timer;
+    unsigned int avail;
+    uint64_t expirations;
+    int64_t deadline_ns;
+    int64_t start_ns = -1;
+    int64_t now_ns;
+    int64_t max_wait_ns = MAX_WRITE_SLEEP_US * 1000LL;
+    int64_t period_ns;
+    int kernel_frames = 0;
+
+    /* deep buffer writes wait for a whole period to drain */
+    period_ns = ((int64_t)out->pcm_config->period_size * NSEC_PER_SEC) /
+            out->pcm_config->rate;
+    if (max_wait_ns < period_ns)
+        max_wait_ns = period_ns;
+
+    for (;;) {
+        if (pcm_get_htimestamp(out->pcm, &avail, &time_stamp) < 0)
+            break;
+        kernel_frames = pcm_get_buffer_size(out->pcm) - avail;
+        if (kernel_frames <= out->cur_write_threshold)
+            break;
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        now_ns = timespec_to_ns(&now);
+        if (start_ns < 0)
+            start_ns = now_ns;
+
+        deadline_ns = timespec_to_ns(&time_stamp) +
+                ((int64_t)(kernel_frames - out->cur_write_threshold) *
+                        NSEC_PER_SEC) / out->pcm_config->rate;
+        if (deadline_ns - now_ns < MIN_WRITE_SLEEP_US * 1000LL)
+            break;
+        if (deadline_ns - start_ns > max_wait_ns) {
+            ALOGW("out_write() limiting sleep time %d to %d",
+                  (int)((deadline_ns - start_ns) / 1000),
+                  (int)(max_wait_ns / 1000));
+            deadline_ns = start_ns + max_wait_ns;
+        }
+
+        if (out->pace_fd >= 0) {
+            memset(&timer, 0, sizeof(timer));
+            timer.it_value.tv_sec = deadline_ns / NSEC_PER_SEC;
+            timer.it_value.tv_nsec = deadline_ns % NSEC_PER_SEC;
+            if (timerfd_settime(out->pace_fd, TFD_TIMER_ABSTIME,
+                                &timer, NULL) < 0 ||
+                    read(out->pace_fd, &expirations,
+                         sizeof(expirations)) < 0)
+                usleep((deadline_ns - now_ns) / 1000);
+        } else {
+            usleep((deadline_ns - now_ns) / 1000);
+        }
+
+        if (deadline_ns - start_ns >= max_wait_ns)
+            break;
+    }
+
+    return kernel_frames;
+}
+
+/* must be called with output stream mutex locked */
+static int out_mmap_xrun(struct stream_out *out)
+{
+    ALOGW("out_write() mmap underrun");
+    pcm_prepare(out->pcm);
+    out->mmap_running = false;
+    return -EPIPE;
+}
+
+/*
+ * Renders frames straight into the DMA buffer of an mmap pcm, resampling or
+ * downmixing on the way, and starts the pcm once the
+ * buffer holds start_threshold frames.
+ * must be called with output stream mutex locked
+ */
+static int out_write_mmap(struct stream_out *out, const int16_t *buffer,
+                          size_t in_frames, bool downmix)
+{
+    unsigned int buffer_size = pcm_get_buffer_size(out->pcm);
+    unsigned int channels = downmix ? 2 : out->pcm_config->channels;
+    unsigned int offset, frames;
+    size_t src_frames, dst_frames;
+    int16_t bounce[OUT_MMAP_BOUNCE_FRAMES * 2];     /* stereo at most */
+    size_t bounce_pos = 0, bounce_frames = 0;
+    int16_t *dst;
+    void *areas;
+    int avail;
+    int ret;
+
+    while (in_frames > 0 || bounce_frames > 0) {
+        avail = pcm_mmap_avail(out->pcm);
+        if (avail < 0 || (unsigned int)avail > buffer_size)
+            return out_mmap_xrun(out);
+
+        if (avail == 0) {
+            /* a full buffer that is not playing yet only needs starting */
+            if (!out->mmap_running) {
+                if (pcm_start(out->pcm) < 0)
+                    return out_mmap_xrun(out);
+                out->mmap_running = true;
+            }
+            ret = pcm_wait(out->pcm, (buffer_size * 1000) /
+                                         out->pcm_config->rate + 1);
+            if (ret < 0)
+                return out_mmap_xrun(out);
+            continue;
+        }
+
+        frames = avail;
+        if (pcm_mmap_begin(out->pcm, &areas, &offset, &frames) < 0)
+            return out_mmap_xrun(out);
+        dst = (int16_t *)((char *)areas + pcm_frames_to_bytes(out->pcm, offset));
+
+        if (bounce_frames > 0) {
+            /* the rest of the frames resampled across the end of the buffer */
+            if (frames > bounce_frames)
+                frames = bounce_frames;
+            memcpy(dst, bounce + bounce_pos * out->pcm_config->channels,
+                   pcm_frames_to_bytes(out->pcm, frames));
+            bounce_pos += frames;
+            bounce_frames -= frames;
+            src_frames = 0;
+        } else if (out->resampler) {
+            src_frames = in_frames;
+            dst_frames = frames;
+            out->resampler->resample_from_input(out->resampler,
+                                                (int16_t *)buffer, &src_frames,
+                                                dst, &dst_frames);
+            if (src_frames == 0 && dst_frames == 0 &&
+                    frames < (unsigned int)avail) {
+                /*
+                 * The window is cut by the end of the buffer, which waiting
+                 * does not change. Resample into the bounce buffer, which
+                 * is copied on both sides of the wrap.
+                 */
+                src_frames = in_frames;
+                dst_frames = (unsigned int)avail;
+                if (dst_frames * out->pcm_config->channels >
+                        sizeof(bounce) / sizeof(bounce[0]))
+                    dst_frames = sizeof(bounce) / sizeof(bounce[0]) /
+                            out->pcm_config->channels;
+                out->resampler->resample_from_input(out->resampler,
+                                                    (int16_t *)buffer,
+                                                    &src_frames,
+                                                    bounce, &dst_frames);
+                if (src_frames == 0 && dst_frames == 0) {
+                    ALOGW("out_write() mmap resampler stalled, %u frames "
+                          "dropped", (unsigned int)in_frames);
+                    return -EIO;
+                }
+                if (frames > dst_frames)
+                    frames = dst_frames;
+                memcpy(dst, bounce, pcm_frames_to_bytes(out->pcm, frames));
+                bounce_pos = frames;
+                bounce_frames = dst_frames - frames;
+                dst_frames = frames;
+            }
+            if (src_frames == 0 && dst_frames == 0) {
+                /*
+                 * The window is too short for the resampler to make a
+                 * frame. Wait for the hardware to free more of the buffer,
+                 * unless it is the whole buffer already.
+                 */
+                if (frames >= buffer_size) {
+                    ALOGW("out_write() mmap resampler stalled, %u frames "
+                          "dropped", (unsigned int)in_frames);
+                    return -EIO;
+                }
+                if (!out->mmap_running) {
+                    if (pcm_start(out->pcm) < 0)
+                        return out_mmap_xrun(out);
+                    out->mmap_running = true;
+                }
+                usleep((int64_t)out->pcm_config->period_size * 1000000 /
+                       out->pcm_config->rate / 4);
+                continue;
+            }
+            frames = dst_frames;
+        } else {
+            if (frames > in_frames)
+                frames = in_frames;
+            src_frames = frames;
+            if (downmix) {
+                downmix_stereo_to_mono(dst, buffer, frames, OUT_DOWNMIX_MODE);
+            } else {
+                memcpy(dst, buffer, pcm_frames_to_bytes(out->pcm, frames));
+            }
+        }
+        buffer += src_frames * channels;
+        in_frames -= src_frames;
+
+        ret = pcm_mmap_commit(out->pcm, offset, frames);
+        if (ret < 0)
+            return out_mmap_xrun(out);
+    }
+
+    if (!out->mmap_running) {
+        avail = pcm_mmap_avail(out->pcm);
+        if (avail >= 0 && buffer_size - avail >= out->pcm_config->start_threshold) {
+            if (pcm_start(out->pcm) < 0)
+                return out_mmap_xrun(out);
+            out->mmap_running = true;
+        }
+    }
 
-    str_parms_destroy(parms);
-    return ret;
+    return 0;
 }
 
-static char * out_get_parameters(const struct audio_stream *stream, const char *keys)
+/* must be called with output stream mutex locked */
+static int out_write_frames(struct stream_out *out, const int16_t *buffer,
+                            size_t frames, size_t frame_size, bool downmix)
 {
-    return strdup("");
+    if (out->mmap)
+        return out_write_mmap(out, buffer, frames, downmix);
+    return pcm_write(out->pcm, buffer, frames * frame_size);
 }
 
-static uint32_t out_get_latency(const struct audio_stream_out *stream)
+/*
+ * Frames out_write() lets queue in the pcm: write_threshold, plus what is
+ * left of the raise after the last underruns.
+ * must be called with output stream mutex locked
+ */
+static int out_target_threshold(struct stream_out *out)
+{
+    int period_size = out->pcm_config->period_size;
+    int max_threshold = period_size * (out->pcm_config->period_count - 1);
+    int64_t decay_ns = OUT_UNDERRUN_DECAY_MS * 1000000LL;
+    struct timespec now;
+    int64_t steps;
+
+    if (out->underrun_boost > 0) {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        steps = (timespec_to_ns(&now) - out->boost_ns) / decay_ns;
+        if (steps > 0) {
+            out->boost_ns += steps * decay_ns;
+            if (steps * period_size >= out->underrun_boost)
+                out->underrun_boost = 0;
+            else
+                out->underrun_boost -= steps * period_size;
+        }
+    }
+
+    if (out->write_threshold + out->underrun_boost > max_threshold)
+        return max_threshold > out->write_threshold ? max_threshold :
+                                                      out->write_threshold;
+    return out->write_threshold + out->underrun_boost;
+}
+
+/*
+ * After an underrun the pcm is prepared again and empty. Raises the write
+ * threshold by a period, so that a loaded system keeps more frames queued,
+ * and queues some silence for the next write not to run dry right away.
+ * frame_size and downmix describe the frames out_write_frames() gets.
+ * must be called with output stream mutex locked
+ */
+static void out_recover_underrun(struct stream_out *out, size_t frame_size,
+                                 bool downmix, bool sco_on)
 {
-    struct stream_out *out = (struct stream_out *)stream;
     struct audio_device *adev = out->dev;
-    size_t period_count;
+    struct timespec now;
+    uint32_t rate;
+    size_t frames;
+    void *silence;
 
-    pthread_mutex_lock(&adev->lock);
+    if (!sco_on) {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        out->underrun_boost += out->pcm_config->period_size;
+        out->boost_ns = timespec_to_ns(&now);
+        out->cur_write_threshold = out_target_threshold(out);
+        /* what the cap in out_target_threshold() allows */
+        out->underrun_boost = out->cur_write_threshold - out->write_threshold;
+        stats_hist_add(&out->stats.underrun_boost, out->underrun_boost);
+    }
 
-    if (adev->screen_off && !adev->active_in && !(adev->out_device & AUDIO_DEVICE_OUT_ALL_SCO))
-        period_count = OUT_LONG_PERIOD_COUNT;
-    else
-        period_count = OUT_SHORT_PERIOD_COUNT;
+    /* mmap frames are resampled while being written */
+    rate = out->mmap ? out_get_sample_rate(&out->stream.common) :
+                       out->pcm_config->rate;
+    frames = (size_t)adev->out_xrun_prefill_ms * rate / 1000;
+    if (frames > (size_t)out->cur_write_threshold)
+        frames = out->cur_write_threshold;
 
-    pthread_mutex_unlock(&adev->lock);
+    ALOGW("out_write() underrun, write threshold %d frames, %u frames of "
+          "silence", out->cur_write_threshold, (unsigned int)frames);
+    if (frames == 0)
+        return;
 
-    return (pcm_config_out.period_size * period_count * 1000) / pcm_config_out.rate;
+    silence = calloc(frames, frame_size);
+    if (!silence)
+        return;
+    if (out_write_frames(out, silence, frames, frame_size, downmix) == 0)
+        stats_add(&out->stats.prefill_frames, frames);
+    free(silence);
 }
 
-static int out_set_volume(struct audio_stream_out *stream, float left,
-                          float right)
+/*
+ * Queues the frames of a mixed stream, waiting for room in its ring for as
+ * long as the mixer takes to play the frames that do not fit yet.
+ */
+static ssize_t out_write_ring(struct stream_out *out, const void *buffer,
+                              size_t bytes)
 {
-    return -ENOSYS;
+    struct audio_device *adev = out->dev;
+    size_t frame_size = audio_stream_frame_size(&out->stream.common);
+    const int16_t *frames = (const int16_t *)buffer;
+    size_t count = bytes / frame_size;
+    size_t written;
+    bool was_empty;
+    int64_t sleep_us;
+    int64_t start_us = stats_now_us();
+
+    pthread_mutex_lock(&out->lock);
+    out->written += count;
+    while (count) {
+        was_empty = sw_ring_readable(out->ring) == 0;
+        written = sw_ring_write(out->ring, frames, count);
+        frames += written * (frame_size / sizeof(int16_t));
+        count -= written;
+
+        /* the mixer sleeps once every ring is empty */
+        if (written && was_empty) {
+            pthread_mutex_lock(&adev->mixer_lock);
+            pthread_cond_signal(&adev->mixer_cond);
+            pthread_mutex_unlock(&adev->mixer_lock);
+        }
+
+        if (count) {
+            sleep_us = (int64_t)count * 1000000 / out->sample_rate;
+            if (sleep_us < MIN_WRITE_SLEEP_US)
+                sleep_us = MIN_WRITE_SLEEP_US;
+            usleep(sleep_us);
+            stats_hist_add(&out->stats.pace_us, sleep_us);
+        }
+    }
+    pthread_mutex_unlock(&out->lock);
+    stats_hist_add_since(&out->stats.write_us, start_us);
+
+    return bytes;
 }
 
 static ssize_t out_write(struct audio_stream_out *stream, const void* buffer,
@@ -909,37 +1963,48 @@ static ssize_t out_write(struct audio_stream_out *stream, const void* buffer,
     int buffer_type;
     int kernel_frames;
     bool sco_on;
+    bool downmix;
+    int64_t start_us, pcm_start_us;
+    struct dev_state state;
+
+    if (out->ring)
+        return out_write_ring(out, buffer, bytes);
+
+    start_us = stats_now_us();
 
     /*
-     * acquiring hw device mutex systematically is useful if a low
-     * priority thread is waiting on the output stream mutex - e.g.
-     * executing out_set_parameters() while holding the hw device
-     * mutex
+     * The hw device mutex is only needed to leave standby. It is taken
+     * before the output stream mutex, and standby checked again, since
+     * out_set_parameters() may have changed it in between.
      */
-    pthread_mutex_lock(&adev->lock);
     pthread_mutex_lock(&out->lock);
+    /* frames that fail to play are dropped, they count as written too */
+    out->written += in_frames;
     if (out->standby) {
-        ret = start_output_stream(out);
-        if (ret != 0) {
-            pthread_mutex_unlock(&adev->lock);
-            goto exit;
+        pthread_mutex_unlock(&out->lock);
+        pthread_mutex_lock(&adev->lock);
+        pthread_mutex_lock(&out->lock);
+        if (out->standby) {
+            ret = start_output_stream(out);
+            if (ret != 0) {
+                pthread_mutex_unlock(&adev->lock);
+                goto exit;
+            }
+            out->standby = false;
+            out->standby_written = out->written - in_frames;
+            stats_inc(&out->stats.resume);
         }
-        out->standby = false;
+        pthread_mutex_unlock(&adev->lock);
     }
-    buffer_type = (adev->screen_off && !adev->active_in) ?
+    dev_state_read(adev, &state);
+    buffer_type = (state.screen_off && !state.in_active) ?
             OUT_BUFFER_TYPE_LONG : OUT_BUFFER_TYPE_SHORT;
-    sco_on = (adev->out_device & AUDIO_DEVICE_OUT_ALL_SCO);
-    pthread_mutex_unlock(&adev->lock);
+    sco_on = (state.out_device & AUDIO_DEVICE_OUT_ALL_SCO);
 
     /* detect changes in screen ON/OFF state and adapt buffer size
      * if needed. Do not change buffer size when routed to SCO device. */
     if (!sco_on && (buffer_type != out->buffer_type)) {
-        size_t period_count;
-
-        if (buffer_type == OUT_BUFFER_TYPE_LONG)
-            period_count = OUT_LONG_PERIOD_COUNT;
-        else
-            period_count = OUT_SHORT_PERIOD_COUNT;
+        size_t period_count = out_queued_periods(out, buffer_type);
 
         out->write_threshold = out->pcm_config->period_size * period_count;
         /* reset current threshold if exiting standby */
@@ -948,22 +2013,61 @@ static ssize_t out_write(struct audio_stream_out *stream, const void* buffer,
         out->buffer_type = buffer_type;
     }
 
-    /* Reduce number of channels, if necessary */
-    if (popcount(out_get_channels(&stream->common)) >
-                 (int)out->pcm_config->channels) {
-        unsigned int i;
+    /* Convert to the format of the pcm, which is S16 whenever the frames
+     * are resampled or downmixed below. */
+    if (out->sample_format != out->pcm_sample_format) {
+        size_t channels = frame_size / format_sample_size(out->sample_format);
+        size_t samples = in_frames * channels;
+        size_t size = samples * format_sample_size(out->pcm_sample_format);
+
+        if (size > out->convert_size) {
+            void *buf = realloc(out->convert_buffer, size);
+            if (!buf) {
+                ret = -ENOMEM;
+                goto exit;
+            }
+            out->convert_buffer = buf;
+            out->convert_size = size;
+        }
+        format_convert(out->convert_buffer, out->pcm_sample_format,
+                       in_buffer, out->sample_format, samples,
+                       adev->out_dither ? &out->dither : NULL);
+        in_buffer = out->convert_buffer;
+        frame_size = channels * format_sample_size(out->pcm_sample_format);
+    }
 
-        /* Discard right channel */
-        for (i = 1; i < in_frames; i++)
-            in_buffer[i] = in_buffer[i * 2];
+    /* Reduce number of channels, if necessary. In mmap mode without
+     * resampling this is done while copying into the pcm buffer. */
+    downmix = popcount(out_get_channels(&stream->common)) >
+                  (int)out->pcm_config->channels;
+    if (downmix && (!out->mmap || out->resampler)) {
+        downmix_stereo_to_mono(in_buffer, in_buffer, in_frames,
+                               OUT_DOWNMIX_MODE);
 
         /* The frame size is now half */
         frame_size /= 2;
+        downmix = false;
     }
 
-    /* Change sample rate, if necessary */
-    if (out_get_sample_rate(&stream->common) != out->pcm_config->rate) {
-        out_frames = out->buffer_frames;
+    /* Change sample rate, if necessary. In mmap mode the resampler writes
+     * into the pcm buffer. */
+    if (out->mmap) {
+        out_frames = in_frames;
+    } else if (out_get_sample_rate(&stream->common) != out->pcm_config->rate) {
+        /* the buffer only fits a period, grow it so that writes of any
+           size are resampled whole */
+        out_frames = (in_frames * out->pcm_config->rate) /
+                out_get_sample_rate(&stream->common) + 1;
+        if (out_frames > out->buffer_frames) {
+            void *buf = realloc(out->buffer,
+                                pcm_frames_to_bytes(out->pcm, out_frames));
+            if (!buf) {
+                ret = -ENOMEM;
+                goto exit;
+            }
+            out->buffer = buf;
+            out->buffer_frames = out_frames;
+        }
         out->resampler->resample_from_input(out->resampler,
                                             in_buffer, &in_frames,
                                             out->buffer, &out_frames);
@@ -973,37 +2077,15 @@ static ssize_t out_write(struct audio_stream_out *stream, const void* buffer,
     }
 
     if (!sco_on) {
-        int total_sleep_time_us = 0;
         size_t period_size = out->pcm_config->period_size;
+        int target_threshold;
 
         /* do not allow more than out->cur_write_threshold frames in kernel
          * pcm driver buffer */
-        do {
-            struct timespec time_stamp;
-            if (pcm_get_htimestamp(out->pcm,
-                                   (unsigned int *)&kernel_frames,
-                                   &time_stamp) < 0)
-                break;
-            kernel_frames = pcm_get_buffer_size(out->pcm) - kernel_frames;
-
-            if (kernel_frames > out->cur_write_threshold) {
-                int sleep_time_us =
-                    (int)(((int64_t)(kernel_frames - out->cur_write_threshold)
-                                    * 1000000) / out->pcm_config->rate);
-                if (sleep_time_us < MIN_WRITE_SLEEP_US)
-                    break;
-                total_sleep_time_us += sleep_time_us;
-                if (total_sleep_time_us > MAX_WRITE_SLEEP_US) {
-                    ALOGW("out_write() limiting sleep time %d to %d",
-                          total_sleep_time_us, MAX_WRITE_SLEEP_US);
-                    sleep_time_us = MAX_WRITE_SLEEP_US -
-                                        (total_sleep_time_us - sleep_time_us);
-                }
-                usleep(sleep_time_us);
-            }
-
-        } while ((kernel_frames > out->cur_write_threshold) &&
-                (total_sleep_time_us <= MAX_WRITE_SLEEP_US));
+        pcm_start_us = stats_now_us();
+        kernel_frames = out_pace_write(out);
+        stats_hist_add_since(&out->stats.pace_us, pcm_start_us);
+        stats_hist_add(&out->stats.kernel_frames, kernel_frames);
 
         /* do not allow abrupt changes on buffer size. Increasing/decreasing
          * the threshold by steps of 1/4th of the buffer size keeps the write
@@ -1012,28 +2094,39 @@ static ssize_t out_write(struct audio_stream_out *stream, const void* buffer,
          * kernel buffer is really depleted to allow for smooth catching up with
          * target threshold.
          */
-        if (out->cur_write_threshold > out->write_threshold) {
+        target_threshold = out_target_threshold(out);
+        if (out->cur_write_threshold > target_threshold) {
             out->cur_write_threshold -= period_size / 4;
-            if (out->cur_write_threshold < out->write_threshold) {
-                out->cur_write_threshold = out->write_threshold;
+            if (out->cur_write_threshold < target_threshold) {
+                out->cur_write_threshold = target_threshold;
             }
-        } else if (out->cur_write_threshold < out->write_threshold) {
+        } else if (out->cur_write_threshold < target_threshold) {
             out->cur_write_threshold += period_size / 4;
-            if (out->cur_write_threshold > out->write_threshold) {
-                out->cur_write_threshold = out->write_threshold;
+            if (out->cur_write_threshold > target_threshold) {
+                out->cur_write_threshold = target_threshold;
             }
-        } else if ((kernel_frames < out->write_threshold) &&
-            ((out->write_threshold - kernel_frames) >
+        } else if ((kernel_frames < target_threshold) &&
+            ((target_threshold - kernel_frames) >
                 (int)(period_size * OUT_SHORT_PERIOD_COUNT))) {
             out->cur_write_threshold = (kernel_frames / period_size + 1) * period_size;
             out->cur_write_threshold += period_size / 4;
         }
     }
 
-    ret = pcm_write(out->pcm, in_buffer, out_frames * frame_size);
+    pcm_start_us = stats_now_us();
+    ret = out_write_frames(out, in_buffer, out_frames, frame_size, downmix);
+    if (ret == -EPIPE) {
+        /* play the frames after some silence rather than drop them */
+        stats_inc(&out->stats.underruns);
+        out_recover_underrun(out, frame_size, downmix, sco_on);
+        ret = out_write_frames(out, in_buffer, out_frames, frame_size,
+                               downmix);
+    }
+    stats_hist_add_since(&out->stats.pcm_write_us, pcm_start_us);
     if (ret == -EPIPE) {
         /* In case of underrun, don't sleep since we want to catch up asap */
         pthread_mutex_unlock(&out->lock);
+        stats_hist_add_since(&out->stats.write_us, start_us);
         return ret;
     }
 
@@ -1044,14 +2137,175 @@ exit:
         usleep(bytes * 1000000 / audio_stream_frame_size(&stream->common) /
                out_get_sample_rate(&stream->common));
     }
+    stats_hist_add_since(&out->stats.write_us, start_us);
 
     return bytes;
 }
 
+/* must be called with mixer_lock locked */
+static bool out_mixer_has_frames(struct audio_device *adev)
+{
+    unsigned int i;
+
+    for (i = 0; i < OUT_MIXER_MAX_STREAMS; i++)
+        if (adev->mixer_streams[i] &&
+                sw_ring_readable(adev->mixer_streams[i]->ring))
+            return true;
+    return false;
+}
+
+/*
+ * Mixes a period of every stream queued to the mixer and writes it to
+ * mixer_out, which paces the loop. Streams that have not queued a whole
+ * period are mixed with silence for the rest. Once all the rings have been
+ * empty for OUT_MIXER_IDLE_PERIODS periods, mixer_out goes to standby until
+ * frames are queued again.
+ */
+static void *out_mixer_thread_loop(void *context)
+{
+    struct audio_device *adev = (struct audio_device *)context;
+    struct stream_out *mixer_out = adev->mixer_out;
+    size_t frame_size = audio_stream_frame_size(&mixer_out->stream.common);
+    size_t bytes = out_get_buffer_size(&mixer_out->stream.common);
+    size_t samples = bytes / sizeof(int16_t);
+    unsigned int idle = OUT_MIXER_IDLE_PERIODS;
+    struct stream_out *out;
+    int32_t *mix;
+    int16_t *buffer;
+    bool playing;
+    unsigned int i;
+
+    mix = malloc(samples * sizeof(int32_t));
+    buffer = malloc(bytes);
+    if (!mix || !buffer) {
+        ALOGE("Unable to allocate the mixer buffers");
+        goto exit;
+    }
+
+    for (;;) {
+        pthread_mutex_lock(&adev->mixer_lock);
+        if (idle >= OUT_MIXER_IDLE_PERIODS && !adev->mixer_exit &&
+                !out_mixer_has_frames(adev)) {
+            pthread_mutex_unlock(&adev->mixer_lock);
+            out_standby(&mixer_out->stream.common);
+            pthread_mutex_lock(&adev->mixer_lock);
+            while (!adev->mixer_exit && !out_mixer_has_frames(adev))
+                pthread_cond_wait(&adev->mixer_cond, &adev->mixer_lock);
+        }
+        if (adev->mixer_exit) {
+            pthread_mutex_unlock(&adev->mixer_lock);
+            break;
+        }
+
+        memset(mix, 0, samples * sizeof(int32_t));
+        playing = false;
+        for (i = 0; i < OUT_MIXER_MAX_STREAMS; i++) {
+            out = adev->mixer_streams[i];
+            if (out && sw_ring_mix(out->ring, mix, bytes / frame_size))
+                playing = true;
+        }
+        pthread_mutex_unlock(&adev->mixer_lock);
+
+        idle = playing ? 0 : idle + 1;
+        sw_mix_saturate(buffer, mix, samples);
+        out_write(&mixer_out->stream, buffer, bytes);
+    }
+
+exit:
+    free(mix);
+    free(buffer);
+    return NULL;
+}
+
+/*
+ * Gets the stream frames written but not played yet, and the time of the
+ * pcm timestamp that this was computed from.
+ * must be called with output stream mutex locked
+ */
+static int out_get_pending_frames(struct stream_out *out, uint64_t *frames,
+                                  struct timespec *timestamp)
+{
+    struct stream_out *mixer_out = out->dev->mixer_out;
+    unsigned int avail;
+    int ret;
+
+    /* mixed frames wait in the ring, then in the pcm of the mixer */
+    if (out->ring) {
+        pthread_mutex_lock(&mixer_out->lock);
+        ret = out_get_pending_frames(mixer_out, frames, timestamp);
+        pthread_mutex_unlock(&mixer_out->lock);
+        if (ret == 0)
+            *frames += sw_ring_readable(out->ring);
+        return ret;
+    }
+
+    if (out->standby || !out->pcm)
+        return -ENODATA;
+    if (pcm_get_htimestamp(out->pcm, &avail, timestamp) < 0)
+        return -ENODATA;
+
+    *frames = (uint64_t)(pcm_get_buffer_size(out->pcm) - avail) *
+            out->sample_rate / out->pcm_config->rate;
+    if (out->resampler)
+        *frames += (uint64_t)out->resampler->delay_ns(out->resampler) *
+                out->sample_rate / NSEC_PER_SEC;
+    return 0;
+}
+
+/*
+ * Gets the stream frames played since the stream was opened. The silence
+ * queued after an underrun is pending but was never written, the position
+ * stalls while it plays rather than going back.
+ * must be called with output stream mutex locked
+ */
+static int out_get_position(struct stream_out *out, uint64_t *frames,
+                            struct timespec *timestamp)
+{
+    uint64_t pending;
+    int ret;
+
+    ret = out_get_pending_frames(out, &pending, timestamp);
+    if (ret != 0)
+        return ret;
+
+    *frames = out->written > pending ? out->written - pending : 0;
+    if (*frames < out->presented)
+        *frames = out->presented;
+    out->presented = *frames;
+    return 0;
+}
+
 static int out_get_render_position(const struct audio_stream_out *stream,
                                    uint32_t *dsp_frames)
 {
-    return -EINVAL;
+    struct stream_out *out = (struct stream_out *)stream;
+    struct timespec timestamp;
+    uint64_t frames;
+    int ret;
+
+    pthread_mutex_lock(&out->lock);
+    ret = out_get_position(out, &frames, &timestamp);
+    if (ret == 0)
+        *dsp_frames = frames > out->standby_written ?
+                frames - out->standby_written : 0;
+    pthread_mutex_unlock(&out->lock);
+
+    return ret;
+}
+
+/* the timestamp is CLOCK_MONOTONIC, as the pcms are opened PCM_MONOTONIC */
+static int out_get_presentation_position(const struct audio_stream_out *stream,
+                                         uint64_t *frames,
+                                         struct timespec *timestamp)
+{
+    struct stream_out *out = (struct stream_out *)stream;
+    int ret;
+
+    pthread_mutex_lock(&out->lock);
+    ret = out_get_position(out, frames, timestamp);
+    pthread_mutex_unlock(&out->lock);
+
+    return ret;
 }
 
 static int out_add_audio_effect(const struct audio_stream *stream, effect_handle_t effect)
@@ -1107,7 +2361,9 @@ static uint32_t in_get_channels(const struct audio_stream *stream)
 
 static audio_format_t in_get_format(const struct audio_stream *stream)
 {
-    return AUDIO_FORMAT_PCM_16_BIT;
+    struct stream_in *in = (struct stream_in *)stream;
+
+    return in->format;
 }
 
 static int in_set_format(struct audio_stream *stream, audio_format_t format)
@@ -1130,6 +2386,18 @@ static int in_standby(struct audio_stream *stream)
 
 static int in_dump(const struct audio_stream *stream, int fd)
 {
+    struct stream_in *in = (struct stream_in *)stream;
+    struct in_stats *stats = &in->stats;
+
+    stats_print(fd, " input %p: %u Hz, format %#x%s\n", in,
+                in->requested_rate, in->format, in->mmap ? ", mmap" : "");
+    stats_print_hist(fd, "read", "us", &stats->read_us);
+    stats_print_hist(fd, "pcm_read", "us", &stats->pcm_read_us);
+    stats_print_count(fd, "overruns", &stats->overruns);
+    stats_print_count(fd, "read_errors", &stats->read_errors);
+    stats_print_count(fd, "standby", &stats->standby);
+    stats_print_count(fd, "resume", &stats->resume);
+
     return 0;
 }
 
@@ -1171,10 +2439,58 @@ static int in_set_parameters(struct audio_stream *stream, const char *kvpairs)
     return ret;
 }
 
+/*
+ * Gets the stream frames captured so far, including the dropped ones and
+ * those not read yet, and the time that was true at.
+ * must be called with input stream mutex locked
+ */
+static int in_get_capture_position(struct stream_in *in, uint64_t *frames,
+                                   int64_t *time_ns)
+{
+    struct timespec time_stamp;
+    unsigned int avail;
+
+    if (in->standby || !in->pcm)
+        return -ENODATA;
+    if (pcm_get_htimestamp(in->pcm, &avail, &time_stamp) < 0)
+        return -ENODATA;
+
+    /* mapped frames are still in avail until they are committed */
+    if (!in->mmap)
+        avail += in->frames_in;
+    *frames = in->frames_read + in->frames_dropped +
+            (uint64_t)avail * in_get_sample_rate(&in->stream.common) /
+                    in->pcm_config->rate;
+    *time_ns = timespec_to_ns(&time_stamp);
+    return 0;
+}
+
 static char * in_get_parameters(const struct audio_stream *stream,
                                 const char *keys)
 {
-    return strdup("");
+    struct stream_in *in = (struct stream_in *)stream;
+    struct str_parms *query;
+    char value[64];
+    uint64_t frames;
+    int64_t time_ns;
+    int ret = -ENODATA;
+
+    query = str_parms_create_str(keys);
+    if (!query)
+        return strdup("");
+    if (str_parms_get_str(query, IN_CAPTURE_POSITION_KEY, value,
+                          sizeof(value)) >= 0) {
+        pthread_mutex_lock(&in->lock);
+        ret = in_get_capture_position(in, &frames, &time_ns);
+        pthread_mutex_unlock(&in->lock);
+    }
+    str_parms_destroy(query);
+
+    if (ret < 0)
+        return strdup("");
+    snprintf(value, sizeof(value), IN_CAPTURE_POSITION_KEY "=%llu,%lld",
+             (unsigned long long)frames, (long long)time_ns);
+    return strdup(value);
 }
 
 static int in_set_gain(struct audio_stream_in *stream, float gain)
@@ -1189,49 +2505,78 @@ static ssize_t in_read(struct audio_stream_in *stream, void* buffer,
     struct stream_in *in = (struct stream_in *)stream;
     struct audio_device *adev = in->dev;
     size_t frames_rq = bytes / audio_stream_frame_size(&stream->common);
+    size_t pcm_bytes = frames_rq * sizeof(int16_t);
+    int16_t *frames = buffer;   /* mono S16 frames read */
+    int64_t start_us = stats_now_us(), pcm_start_us;
+    struct dev_state state;
 
-    /*
-     * acquiring hw device mutex systematically is useful if a low
-     * priority thread is waiting on the input stream mutex - e.g.
-     * executing in_set_parameters() while holding the hw device
-     * mutex
-     */
-    pthread_mutex_lock(&adev->lock);
+    /* as in out_write(), the hw device mutex is only taken to leave
+       standby */
     pthread_mutex_lock(&in->lock);
     if (in->standby) {
-        ret = start_input_stream(in);
-        if (ret == 0)
-            in->standby = 0;
+        pthread_mutex_unlock(&in->lock);
+        pthread_mutex_lock(&adev->lock);
+        pthread_mutex_lock(&in->lock);
+        if (in->standby) {
+            ret = start_input_stream(in);
+            if (ret == 0) {
+                in->standby = 0;
+                stats_inc(&in->stats.resume);
+            }
+        }
+        pthread_mutex_unlock(&adev->lock);
     }
-    pthread_mutex_unlock(&adev->lock);
+    dev_state_read(adev, &state);
+    in->downmix = state.in_downmix;
 
     if (ret < 0)
         goto exit;
 
+    /* the frames are read S16, and converted to the stream format last */
+    if (in->sample_format != SAMPLE_FORMAT_S16) {
+        if (pcm_bytes > in->convert_size) {
+            void *buf = realloc(in->convert_buffer, pcm_bytes);
+            if (!buf) {
+                ret = -ENOMEM;
+                goto exit;
+            }
+            in->convert_buffer = buf;
+            in->convert_size = pcm_bytes;
+        }
+        frames = in->convert_buffer;
+    }
+
     /*if (in->num_preprocessors != 0) {
-        ret = process_frames(in, buffer, frames_rq);
-    } else */if (in->resampler != NULL) {
-        ret = read_frames(in, buffer, frames_rq);
+        ret = process_frames(in, frames, frames_rq);
+    } else */if (in->resampler != NULL || in->mmap) {
+        ret = read_frames(in, frames, frames_rq);
     } else if (in->pcm_config->channels == 2) {
         /*
          * If the PCM is stereo, capture twice as many frames and
-         * discard the right channel.
+         * downmix them.
          */
-        unsigned int i;
-        int16_t *in_buffer = (int16_t *)buffer;
-
-        ret = pcm_read(in->pcm, in->buffer, bytes * 2);
+        pcm_start_us = stats_now_us();
+        ret = pcm_read(in->pcm, in->buffer, pcm_bytes * 2);
+        stats_hist_add_since(&in->stats.pcm_read_us, pcm_start_us);
+        if (ret == 0)
+            in_account_frames(in, frames_rq);
 
-        /* Discard right channel */
-        for (i = 0; i < frames_rq; i++)
-            in_buffer[i] = in->buffer[i * 2];
+        downmix_stereo_to_mono(frames, in->buffer, frames_rq, in->downmix);
     } else {
-        ret = pcm_read(in->pcm, buffer, bytes);
+        pcm_start_us = stats_now_us();
+        ret = pcm_read(in->pcm, frames, pcm_bytes);
+        stats_hist_add_since(&in->stats.pcm_read_us, pcm_start_us);
+        if (ret == 0)
+            in_account_frames(in, frames_rq);
     }
 
     if (ret > 0)
         ret = 0;
 
+    if (ret == 0 && frames != buffer)
+        format_convert(buffer, in->sample_format, frames, SAMPLE_FORMAT_S16,
+                       frames_rq, NULL);
+
     /*
      * Instead of writing zeroes here, we could trust the hardware
      * to always provide zeroes when muted.
@@ -1240,17 +2585,34 @@ static ssize_t in_read(struct audio_stream_in *stream, void* buffer,
         memset(buffer, 0, bytes);
 
 exit:
-    if (ret < 0)
+    /* nothing was captured, rather than stale frames */
+    if (ret < 0) {
+        stats_inc(&in->stats.read_errors);
+        memset(buffer, 0, bytes);
+        in_count_lost(in, frames_rq);
+        /* counted here, the next check must not count the gap again */
+        in->check_ns = 0;
         usleep(bytes * 1000000 / audio_stream_frame_size(&stream->common) /
                in_get_sample_rate(&stream->common));
+    }
+    in->frames_read += frames_rq;
 
     pthread_mutex_unlock(&in->lock);
+    stats_hist_add_since(&in->stats.read_us, start_us);
     return bytes;
 }
 
 static uint32_t in_get_input_frames_lost(struct audio_stream_in *stream)
 {
-    return 0;
+    struct stream_in *in = (struct stream_in *)stream;
+    uint32_t frames_lost;
+
+    pthread_mutex_lock(&in->lock);
+    frames_lost = in->frames_lost;
+    in->frames_lost = 0;
+    pthread_mutex_unlock(&in->lock);
+
+    return frames_lost;
 }
 
 static int in_add_audio_effect(const struct audio_stream *stream,
@@ -1298,9 +2660,69 @@ static int adev_open_output_stream(struct audio_hw_device *dev,
     out->stream.write = out_write;
     out->stream.get_render_position = out_get_render_position;
     out->stream.get_next_write_timestamp = out_get_next_write_timestamp;
+    out->stream.get_presentation_position = out_get_presentation_position;
 
     out->dev = adev;
 
+    out->pace_fd = timerfd_create(CLOCK_MONOTONIC, 0);
+    if (out->pace_fd < 0)
+        ALOGW("Unable to create the write pacing timer, using usleep()");
+
+    /* mixed streams all share the profile of the mixer */
+    if ((flags & AUDIO_OUTPUT_FLAG_FAST) && !adev->mixer_out) {
+        out->profile = OUT_PROFILE_FAST;
+        out->profile_config = &pcm_config_out_fast;
+    } else if ((flags & AUDIO_OUTPUT_FLAG_DEEP_BUFFER) && !adev->mixer_out) {
+        out->profile = OUT_PROFILE_DEEP_BUFFER;
+        out->profile_config = &pcm_config_out_deep;
+    } else {
+        out->profile = OUT_PROFILE_PRIMARY;
+        out->profile_config = &pcm_config_out;
+    }
+
+    /* the pcm is opened at the stream rate if the card allows it */
+    out->sample_rate = config->sample_rate ? config->sample_rate :
+                                             OUT_SAMPLING_RATE;
+
+    /* and in the stream format, other formats than these are played S16 */
+    if (!sample_format_of(config->format, &out->sample_format)) {
+        config->format = AUDIO_FORMAT_PCM_16_BIT;
+        out->sample_format = SAMPLE_FORMAT_S16;
+    }
+    out->format = config->format;
+    format_dither_init(&out->dither, (uint32_t)(uintptr_t)out);
+
+    /* mixed streams run at the rate of the mixer, and queue a few periods */
+    if (adev->mixer_out) {
+        unsigned int i;
+
+        out->sample_rate = adev->mixer_out->sample_rate;
+        out->format = AUDIO_FORMAT_PCM_16_BIT;
+        out->sample_format = SAMPLE_FORMAT_S16;
+        out->ring = sw_ring_create(
+                pcm_config_out.period_size * OUT_MIXER_RING_PERIODS,
+                popcount(out_get_channels(&out->stream.common)));
+        if (!out->ring) {
+            ret = -ENOMEM;
+            goto err_ring;
+        }
+
+        pthread_mutex_lock(&adev->mixer_lock);
+        for (i = 0; i < OUT_MIXER_MAX_STREAMS; i++) {
+            if (!adev->mixer_streams[i]) {
+                adev->mixer_streams[i] = out;
+                break;
+            }
+        }
+        pthread_mutex_unlock(&adev->mixer_lock);
+        if (i == OUT_MIXER_MAX_STREAMS) {
+            ALOGE("Unable to mix more than %d output streams",
+                  OUT_MIXER_MAX_STREAMS);
+            ret = -EBUSY;
+            goto err_mixer;
+        }
+    }
+
     config->format = out_get_format(&out->stream.common);
     config->channel_mask = out_get_channels(&out->stream.common);
     config->sample_rate = out_get_sample_rate(&out->stream.common);
@@ -1310,6 +2732,11 @@ static int adev_open_output_stream(struct audio_hw_device *dev,
     *stream_out = &out->stream;
     return 0;
 
+err_mixer:
+    sw_ring_free(out->ring);
+err_ring:
+    if (out->pace_fd >= 0)
+        close(out->pace_fd);
 err_open:
     free(out);
     *stream_out = NULL;
@@ -1319,7 +2746,22 @@ err_open:
 static void adev_close_output_stream(struct audio_hw_device *dev,
                                      struct audio_stream_out *stream)
 {
+    struct stream_out *out = (struct stream_out *)stream;
+    struct audio_device *adev = (struct audio_device *)dev;
+    unsigned int i;
+
+    if (out->ring) {
+        pthread_mutex_lock(&adev->mixer_lock);
+        for (i = 0; i < OUT_MIXER_MAX_STREAMS; i++)
+            if (adev->mixer_streams[i] == out)
+                adev->mixer_streams[i] = NULL;
+        pthread_mutex_unlock(&adev->mixer_lock);
+        sw_ring_free(out->ring);
+    }
+
     out_standby(&stream->common);
+    if (out->pace_fd >= 0)
+        close(out->pace_fd);
     free(stream);
 }
 
@@ -1364,10 +2806,10 @@ static int adev_set_parameters(struct audio_hw_device *dev, const char *kvpairs)
 
     ret = str_parms_get_str(parms, "screen_state", value, sizeof(value));
     if (ret >= 0) {
-        if (strcmp(value, AUDIO_PARAMETER_VALUE_ON) == 0)
-            adev->screen_off = false;
-        else
-            adev->screen_off = true;
+        pthread_mutex_lock(&adev->lock);
+        adev->screen_off = strcmp(value, AUDIO_PARAMETER_VALUE_ON) != 0;
+        dev_state_publish(adev);
+        pthread_mutex_unlock(&adev->lock);
     }
 
     str_parms_destroy(parms);
@@ -1443,6 +2885,7 @@ static int adev_open_input_stream(struct audio_hw_device *dev,
 {
     struct audio_device *adev = (struct audio_device *)dev;
     struct stream_in *in;
+    enum sample_format sample_format;
     int ret;
 
     *stream_in = NULL;
@@ -1453,6 +2896,12 @@ static int adev_open_input_stream(struct audio_hw_device *dev,
         return -EINVAL;
     }
 
+    /* and for S16 if the format is not supported */
+    if (!sample_format_of(config->format, &sample_format)) {
+        config->format = AUDIO_FORMAT_PCM_16_BIT;
+        return -EINVAL;
+    }
+
     in = (struct stream_in *)calloc(1, sizeof(struct stream_in));
     if (!in)
         return -ENOMEM;
@@ -1476,6 +2925,8 @@ static int adev_open_input_stream(struct audio_hw_device *dev,
     in->dev = adev;
     in->standby = true;
     in->requested_rate = config->sample_rate;
+    in->format = config->format;
+    in->sample_format = sample_format;
     in->pcm_config = &pcm_config_in; /* default PCM config */
 
     *stream_in = &in->stream;
@@ -1493,23 +2944,122 @@ static void adev_close_input_stream(struct audio_hw_device *dev,
 
 static int adev_dump(const audio_hw_device_t *device, int fd)
 {
+    struct audio_device *adev = (struct audio_device *)device;
+
+    /* a stuck device mutex is what a dump is often taken for */
+    if (pthread_mutex_trylock(&adev->lock) == 0) {
+        stats_print(fd, " out_device %#x, in_device %#x, card_out %d, "
+                    "card_in %d%s\n", adev->out_device, adev->in_device,
+                    adev->card_out_index, adev->card_in_index,
+                    adev->screen_off ? ", screen off" : "");
+        pthread_mutex_unlock(&adev->lock);
+    } else {
+        stats_print(fd, " device mutex held\n");
+    }
+    stats_print_hist(fd, "route", "us", &adev->stats.route_us);
+    stats_print_count(fd, "select_devices", &adev->stats.select_devices);
+
+    /* the stream owning the pcm for the mixed ones is not seen by the
+     * framework, so it is dumped here */
+    if (adev->mixer_out)
+        out_dump(&adev->mixer_out->stream.common, fd);
+
     return 0;
 }
 
+/*
+ * Opens the stream the mixer writes to and starts the mixer thread. The
+ * output streams opened afterwards are mixed.
+ */
+static void out_mixer_open(struct audio_device *adev)
+{
+    struct audio_stream_out *stream;
+    struct audio_config config;
+
+    memset(&config, 0, sizeof(config));
+    config.sample_rate = OUT_SAMPLING_RATE;
+    config.channel_mask = AUDIO_CHANNEL_OUT_STEREO;
+    config.format = AUDIO_FORMAT_PCM_16_BIT;
+    if (adev_open_output_stream(&adev->hw_device, 0, adev->out_device,
+                                AUDIO_OUTPUT_FLAG_PRIMARY, &config,
+                                &stream) < 0) {
+        ALOGE("Unable to open the mixer stream");
+        return;
+    }
+
+    pthread_mutex_init(&adev->mixer_lock, NULL);
+    pthread_cond_init(&adev->mixer_cond, NULL);
+    adev->mixer_out = (struct stream_out *)stream;
+    if (pthread_create(&adev->mixer_thread, NULL, out_mixer_thread_loop,
+                       adev)) {
+        ALOGE("Unable to create the mixer thread");
+        adev->mixer_out = NULL;
+        pthread_cond_destroy(&adev->mixer_cond);
+        pthread_mutex_destroy(&adev->mixer_lock);
+        adev_close_output_stream(&adev->hw_device, stream);
+    }
+}
+
+static void out_mixer_close(struct audio_device *adev)
+{
+    if (!adev->mixer_out)
+        return;
+
+    pthread_mutex_lock(&adev->mixer_lock);
+    adev->mixer_exit = true;
+    pthread_cond_signal(&adev->mixer_cond);
+    pthread_mutex_unlock(&adev->mixer_lock);
+    pthread_join(adev->mixer_thread, NULL);
+
+    adev_close_output_stream(&adev->hw_device, &adev->mixer_out->stream);
+    adev->mixer_out = NULL;
+    pthread_cond_destroy(&adev->mixer_cond);
+    pthread_mutex_destroy(&adev->mixer_lock);
+}
+
 static int adev_close(hw_device_t *device)
 {
     struct audio_device *adev = (struct audio_device *)device;
 
+    out_mixer_close(adev);
+
     pthread_mutex_lock(&adev->lock);
+    adev->route_exit = true;
+    pthread_cond_signal(&adev->route_cond);
+    pthread_mutex_unlock(&adev->lock);
+    pthread_join(adev->route_thread, NULL);
+
+    /* the xml watch thread may be waiting for the device mutex, so the
+       route is freed without it */
     audio_route_free(adev->ar);
+
+    pthread_mutex_lock(&adev->lock);
+    adev->ar = NULL;
+    if (adev->card[AUDIO_CARD_USB].card_slot != CARD_SLOT_NOT_FOUND)
+        audio_route_control_release(adev->card[AUDIO_CARD_USB].card_slot);
     pthread_mutex_unlock(&adev->lock);
 
+    pthread_cond_destroy(&adev->route_cond);
+    pthread_cond_destroy(&adev->route_done_cond);
+    card_registry_close(adev->cards);
     free(device);
     return 0;
 }
 
+/* called by the xml watch thread once reloaded mixer paths are ready */
+static void mixer_paths_changed(void *context)
+{
+    struct audio_device *adev = (struct audio_device *)context;
+
+    pthread_mutex_lock(&adev->lock);
+    select_devices(adev);
+    pthread_mutex_unlock(&adev->lock);
+}
+
 static int init_cards_and_route(struct audio_device *adev, bool report_card_errors)
 {
+    char value[PROPERTY_VALUE_MAX];
+
     if (adev->card[adev->card_out_index].card_slot == CARD_SLOT_NOT_FOUND) {
         find_card_slot(adev);
         if (adev->card[adev->card_out_index].card_slot != CARD_SLOT_NOT_FOUND) {
@@ -1518,6 +3068,9 @@ static int init_cards_and_route(struct audio_device *adev, bool report_card_erro
             if (adev->ar == NULL) {
                 return -EINVAL;
             }
+            property_get(MIXER_RELOAD_PROPERTY, value, "0");
+            if (atoi(value))
+                audio_route_watch_xml(adev->ar, mixer_paths_changed, adev);
             /*
                 select_devices will call init_cards_and_route, but there is no
                 deep recursion happening. select_devices will be called only if
@@ -1539,6 +3092,7 @@ static int adev_open(const hw_module_t* module, const char* name,
 {
     struct audio_device *adev;
     int index, ret;
+    char value[PROPERTY_VALUE_MAX];
 
     if (strcmp(name, AUDIO_HARDWARE_INTERFACE) != 0)
         return -EINVAL;
@@ -1573,14 +3127,26 @@ static int adev_open(const hw_module_t* module, const char* name,
     adev->card_out_index = AUDIO_CARD_PCH;
     adev->card[adev->card_out_index].card_slot = CARD_SLOT_NOT_FOUND;
 
+    adev->cards = card_registry_open();
+    if (!adev->cards) {
+        ret = -ENOMEM;
+        goto err_cards;
+    }
+
+    pthread_cond_init(&adev->route_cond, NULL);
+    pthread_cond_init(&adev->route_done_cond, NULL);
+    if (pthread_create(&adev->route_thread, NULL, route_thread_loop, adev)) {
+        ALOGE("Unable to create the route thread");
+        ret = -ENOMEM;
+        goto err_thread;
+    }
+
     pthread_mutex_lock(&adev->lock);
     ret =  init_cards_and_route(adev, false);
     pthread_mutex_unlock(&adev->lock);
 
-    if (ret < 0){
-        free(adev);
-        return ret;
-    }
+    if (ret < 0)
+        goto err_route;
     switch (adev->card_out_index) {
         case AUDIO_CARD_HDMI:
             adev->out_device = AUDIO_DEVICE_OUT_AUX_DIGITAL;
@@ -1596,12 +3162,42 @@ static int adev_open(const hw_module_t* module, const char* name,
 
     adev->card_in_index = AUDIO_CARD_PCH;
     adev->orientation = ORIENTATION_UNDEFINED;
+
+    property_get(OUT_MMAP_PROPERTY, value, "0");
+    adev->out_mmap = atoi(value) != 0;
+    property_get(IN_MMAP_PROPERTY, value, "0");
+    adev->in_mmap = atoi(value) != 0;
+    property_get(OUT_XRUN_PREFILL_PROPERTY, value, OUT_XRUN_PREFILL_DEFAULT);
+    adev->out_xrun_prefill_ms = atoi(value);
+    property_get(OUT_DITHER_PROPERTY, value, "1");
+    adev->out_dither = atoi(value) != 0;
     adev->in_device = AUDIO_DEVICE_IN_BUILTIN_MIC & ~AUDIO_DEVICE_BIT_IN;
 
     *device = &adev->hw_device.common;
 
+    pthread_mutex_lock(&adev->lock);
+    dev_state_publish(adev);
     select_devices(adev);
+    pthread_mutex_unlock(&adev->lock);
+
+    property_get(OUT_MIXER_PROPERTY, value, "0");
+    if (atoi(value) != 0)
+        out_mixer_open(adev);
     return 0;
+
+err_route:
+    pthread_mutex_lock(&adev->lock);
+    adev->route_exit = true;
+    pthread_cond_signal(&adev->route_cond);
+    pthread_mutex_unlock(&adev->lock);
+    pthread_join(adev->route_thread, NULL);
+err_thread:
+    pthread_cond_destroy(&adev->route_cond);
+    pthread_cond_destroy(&adev->route_done_cond);
+    card_registry_close(adev->cards);
+err_cards:
+    free(adev);
+    return ret;
 }
 
 static struct hw_module_methods_t hal_module_methods = {
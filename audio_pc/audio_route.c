@@ -21,31 +21,121 @@
 #include <errno.h>
 #include <expat.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <fcntl.h>
 #include <ctype.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include <cutils/log.h>
 
 #include <tinyalsa/asoundlib.h>
 
+#include "audio_route.h"
+
 #define BUF_SIZE 1024
 #define MIXER_XML_PATH "/system/etc/mixer_paths_%s.xml"
+#define MIXER_CACHE_PATH "/data/misc/audio/mixer_paths_%s.cache"
 #define CODEC_CHIP_NAME_PATH "/sys/class/sound/hwC%uD0/chip_name"
 #define CODEC_CHIP_NAME_UNKNOWN "unknown"
 #define INITIAL_MIXER_PATH_SIZE 8
+#define PATH_INDEX_NONE UINT_MAX
+#define CONTROL_MIXER_MAX_CARDS 32
+#define ROUTE_MEMO_MAX_ROUTES 16
+#define ROUTE_MEMO_MAX_DELTAS 32
+#define ROUTE_NONE UINT_MAX
+#define RELOAD_EVENT_BUF_SIZE 4096
+
+/* value limits of struct snd_ctl_elem_value */
+#define MAX_CTL_INT_VALUES 128
+#define MAX_CTL_BYTE_VALUES 512
+#define MAX_CTL_VALUES MAX_CTL_BYTE_VALUES
+
+/* compiled mixer path cache, written after the xml has been parsed */
+#define ROUTE_CACHE_MAGIC 0x31435241 /* "ARC1" */
+#define ROUTE_CACHE_VERSION 3
+#define ROUTE_CACHE_CODEC_LEN 64
+
+/* the cache is only valid for the same xml file and the same card */
+struct route_cache_key {
+    int64_t xml_mtime;
+    int64_t xml_size;
+    uint32_t xml_hash;      /* of the contents, as the mtime may be fixed */
+    uint32_t ctl_fingerprint;
+    uint32_t num_ctls;
+    char codec[ROUTE_CACHE_CODEC_LEN];
+};
+
+struct route_cache_header {
+    uint32_t magic;
+    uint32_t version;
+    struct route_cache_key key;
+    uint32_t num_init_settings;
+    uint32_t num_paths;
+    uint32_t num_settings;
+    uint32_t num_values;
+    uint32_t strings_size;
+};
+
+/*
+ * The header is followed by the initial settings, the path table, the path
+ * settings, the setting values and the NUL terminated path names.
+ */
+struct route_cache_setting {
+    uint32_t ctl_index;
+    uint32_t id;
+    uint32_t num_values;
+    uint32_t first_value;
+};
 
+struct route_cache_path {
+    uint32_t name_offset;
+    uint32_t first_setting;
+    uint32_t length;
+};
 
+/*
+ * One value per channel (or byte) of the ctl. Values are only read from the
+ * card once the xml or a path needs them.
+ */
 struct mixer_state {
     struct mixer_ctl *ctl;
-    int old_value;
-    int new_value;
-    int reset_value;
+    unsigned int num_values;
+    int *old_value;
+    int *new_value;
+    int *reset_value;
+    bool loaded;  /* new_value and reset_value hold every value */
+    bool synced;  /* old_value matches the card */
+    bool dirty;   /* on the dirty list, new_value may differ from old_value */
+    bool applied; /* on the applied list, new_value may differ from reset_value */
+};
+
+/* name lookup and enum strings of the controls of one card */
+struct mixer_ctl_index {
+    struct mixer *mixer;
+    unsigned int num_ctls;
+    unsigned int hash_size;         /* a power of two */
+    unsigned int *hash;             /* first ctl of each bucket */
+    unsigned int *next;             /* next ctl in the same bucket */
+    unsigned int *num_enums;        /* 0 for non enum ctls */
+    const char ***enum_strings;
 };
 
+/*
+ * settings are compiled to mixer_state indices when the xml is loaded, and
+ * set num_values values of the ctl starting at value id
+ */
 struct mixer_setting {
-    struct mixer_ctl *ctl;
-    int value;
+    unsigned int ctl_index;
+    unsigned int id;
+    unsigned int num_values;
+    int *value;
 };
 
 struct mixer_path {
@@ -53,16 +143,85 @@ struct mixer_path {
     unsigned int size;
     unsigned int length;
     struct mixer_setting *setting;
+    unsigned int next; /* next path in the same hash bucket */
+};
+
+/*
+ * A memoized route: the paths it applies in order, and the resulting values
+ * of every ctl they set, sorted by ctl index. Values are stored one ctl
+ * after the other, num_values each.
+ */
+struct route_memo {
+    unsigned int num_paths;
+    unsigned int *paths;
+    unsigned int num_ctls;
+    unsigned int *ctls;
+    int *values;
+};
+
+/* the ctls to write to go from one memoized route to another */
+struct route_delta {
+    unsigned int from;
+    unsigned int to;
+    unsigned int num_ctls;
+    unsigned int *ctls;
+    int *values;
 };
 
 struct audio_route {
     struct mixer *mixer;
+    struct mixer_ctl_index *ctl_index;
     unsigned int num_mixer_ctls;
     struct mixer_state *mixer_state;
+    int *mixer_values; /* backing store of the mixer_state values */
 
     unsigned int mixer_path_size;
     unsigned int num_mixer_paths;
     struct mixer_path *mixer_path;
+
+    /* path name hash, sized to mixer_path_size (a power of two) */
+    unsigned int *path_hash;
+
+    /* top level ctls of the xml, applied once at init */
+    struct mixer_path init_path;
+
+    /* controls to visit on the next commit */
+    unsigned int num_dirty_ctls;
+    unsigned int *dirty_ctls;
+
+    /* controls set by a path since the last reset */
+    unsigned int num_applied_ctls;
+    unsigned int *applied_ctls;
+
+    /* routes applied by audio_route_apply_route(), and the transitions
+       between them */
+    unsigned int num_routes;
+    struct route_memo route[ROUTE_MEMO_MAX_ROUTES];
+    unsigned int num_deltas;
+    unsigned int next_delta;
+    struct route_delta delta[ROUTE_MEMO_MAX_DELTAS];
+    unsigned int current_route; /* ROUTE_NONE if the mixer isn't on one */
+
+    struct audio_route_stats stats;
+
+    char xml_path[PATH_MAX];
+    char cache_path[PATH_MAX];
+    char codec[ROUTE_CACHE_CODEC_LEN];
+
+    /*
+     * xml reload, see audio_route_watch_xml(). The watcher parses into a
+     * copy of the route that only owns path tables, and leaves it in
+     * reload_pending. The user of the route swaps it in the next time it
+     * applies paths, when no path of the old tables is in use.
+     */
+    pthread_mutex_t reload_lock;
+    struct audio_route *reload_pending;
+    bool reload_watching;
+    pthread_t reload_thread;
+    int reload_fd;
+    int reload_pipe[2];
+    void (*reload_changed)(void *context);
+    void *reload_context;
 };
 
 struct config_parse_state {
@@ -71,8 +230,273 @@ struct config_parse_state {
     int level;
 };
 
+#define FNV_OFFSET_BASIS 2166136261u
+#define FNV_PRIME 16777619u
+
+static unsigned int fnv_update(unsigned int hash, const void *data, size_t len)
+{
+    const unsigned char *p = data;
+
+    while (len--) {
+        hash ^= *p++;
+        hash *= FNV_PRIME;
+    }
+
+    return hash;
+}
+
+/* FNV-1a hash of a path or control name */
+static unsigned int name_hash(const char *name)
+{
+    unsigned int hash = FNV_OFFSET_BASIS;
+
+    while (*name) {
+        hash ^= (unsigned char)*name++;
+        hash *= FNV_PRIME;
+    }
+
+    return hash;
+}
+
+/* control index functions */
+
+static void ctl_index_free(struct mixer_ctl_index *index)
+{
+    unsigned int i;
+
+    if (!index)
+        return;
+
+    if (index->enum_strings) {
+        for (i = 0; i < index->num_ctls; i++)
+            free(index->enum_strings[i]);
+        free(index->enum_strings);
+    }
+    free(index->num_enums);
+    free(index->next);
+    free(index->hash);
+    free(index);
+}
+
+/*
+ * Builds the name hash and reads every enum string of a card once, so
+ * that lookups no longer scan the control list or go back to the mixer.
+ */
+static struct mixer_ctl_index *ctl_index_create(struct mixer *mixer)
+{
+    struct mixer_ctl_index *index;
+    struct mixer_ctl *ctl;
+    const char *name;
+    unsigned int bucket;
+    unsigned int i, j;
+
+    index = calloc(1, sizeof(struct mixer_ctl_index));
+    if (!index)
+        return NULL;
+
+    index->mixer = mixer;
+    index->num_ctls = mixer_get_num_ctls(mixer);
+    index->hash_size = 1;
+    while (index->hash_size < index->num_ctls)
+        index->hash_size <<= 1;
+
+    index->hash = malloc(index->hash_size * sizeof(unsigned int));
+    index->next = malloc((index->num_ctls + 1) * sizeof(unsigned int));
+    index->num_enums = calloc(index->num_ctls + 1, sizeof(unsigned int));
+    index->enum_strings = calloc(index->num_ctls + 1, sizeof(const char **));
+    if (!index->hash || !index->next || !index->num_enums ||
+            !index->enum_strings)
+        goto err;
+
+    for (i = 0; i < index->hash_size; i++)
+        index->hash[i] = PATH_INDEX_NONE;
+
+    /* insert in reverse so that the first of duplicate names is found */
+    for (i = index->num_ctls; i-- > 0;) {
+        ctl = mixer_get_ctl(mixer, i);
+        name = mixer_ctl_get_name(ctl);
+        if (!name)
+            continue;
+        bucket = name_hash(name) & (index->hash_size - 1);
+        index->next[i] = index->hash[bucket];
+        index->hash[bucket] = i;
+
+        if (mixer_ctl_get_type(ctl) != MIXER_CTL_TYPE_ENUM)
+            continue;
+        index->num_enums[i] = mixer_ctl_get_num_enums(ctl);
+        index->enum_strings[i] = malloc(index->num_enums[i] * sizeof(char *));
+        if (!index->enum_strings[i] && index->num_enums[i])
+            goto err;
+        for (j = 0; j < index->num_enums[i]; j++)
+            index->enum_strings[i][j] = mixer_ctl_get_enum_string(ctl, j);
+    }
+
+    return index;
+
+err:
+    ALOGE("Unable to allocate control index");
+    ctl_index_free(index);
+    return NULL;
+}
+
+/* returns the number of the named ctl on the card, or -1 */
+static int ctl_index_find(struct mixer_ctl_index *index, const char *name)
+{
+    unsigned int i;
+    const char *ctl_name;
+
+    i = index->hash[name_hash(name) & (index->hash_size - 1)];
+    while (i != PATH_INDEX_NONE) {
+        ctl_name = mixer_ctl_get_name(mixer_get_ctl(index->mixer, i));
+        if (ctl_name && strcmp(ctl_name, name) == 0)
+            return i;
+        i = index->next[i];
+    }
+
+    return -1;
+}
+
+/* returns the value of an enum string of a ctl, or -1 */
+static int ctl_index_enum_value(struct mixer_ctl_index *index,
+                                unsigned int ctl_num, const char *string)
+{
+    unsigned int i;
+
+    for (i = 0; i < index->num_enums[ctl_num]; i++) {
+        if (index->enum_strings[ctl_num][i] != NULL &&
+                strcmp(index->enum_strings[ctl_num][i], string) == 0)
+            return i;
+    }
+
+    return -1;
+}
+
+/* ctl value functions */
+
+/* number of values of a ctl that can be read and written */
+static unsigned int ctl_num_values(struct mixer_ctl *ctl)
+{
+    unsigned int num_values = mixer_ctl_get_num_values(ctl);
+
+    switch (mixer_ctl_get_type(ctl)) {
+    case MIXER_CTL_TYPE_BOOL:
+    case MIXER_CTL_TYPE_INT:
+    case MIXER_CTL_TYPE_ENUM:
+        return num_values < MAX_CTL_INT_VALUES ? num_values : MAX_CTL_INT_VALUES;
+    case MIXER_CTL_TYPE_BYTE:
+        return num_values < MAX_CTL_BYTE_VALUES ? num_values : MAX_CTL_BYTE_VALUES;
+    default:
+        return 0;
+    }
+}
+
+/* reads every value of a ctl, with a single read for int, bool and byte ctls */
+static int ctl_read_values(struct mixer_ctl *ctl, int *values,
+                           unsigned int num_values)
+{
+    long int_values[MAX_CTL_INT_VALUES];
+    unsigned char byte_values[MAX_CTL_BYTE_VALUES];
+    unsigned int i;
+
+    switch (mixer_ctl_get_type(ctl)) {
+    case MIXER_CTL_TYPE_BOOL:
+    case MIXER_CTL_TYPE_INT:
+        if (mixer_ctl_get_array(ctl, int_values, num_values) < 0)
+            return -1;
+        for (i = 0; i < num_values; i++)
+            values[i] = int_values[i];
+        return 0;
+    case MIXER_CTL_TYPE_BYTE:
+        if (mixer_ctl_get_array(ctl, byte_values, num_values) < 0)
+            return -1;
+        for (i = 0; i < num_values; i++)
+            values[i] = byte_values[i];
+        return 0;
+    case MIXER_CTL_TYPE_ENUM:
+        for (i = 0; i < num_values; i++)
+            values[i] = mixer_ctl_get_value(ctl, i);
+        return 0;
+    default:
+        return -1;
+    }
+}
+
+/* writes every value of a ctl, with a single write for int, bool and byte ctls */
+static int ctl_write_values(struct mixer_ctl *ctl, const int *values,
+                            unsigned int num_values)
+{
+    long int_values[MAX_CTL_INT_VALUES];
+    unsigned char byte_values[MAX_CTL_BYTE_VALUES];
+    unsigned int i;
+
+    switch (mixer_ctl_get_type(ctl)) {
+    case MIXER_CTL_TYPE_BOOL:
+    case MIXER_CTL_TYPE_INT:
+        for (i = 0; i < num_values; i++)
+            int_values[i] = values[i];
+        return mixer_ctl_set_array(ctl, int_values, num_values);
+    case MIXER_CTL_TYPE_BYTE:
+        for (i = 0; i < num_values; i++)
+            byte_values[i] = values[i];
+        return mixer_ctl_set_array(ctl, byte_values, num_values);
+    case MIXER_CTL_TYPE_ENUM:
+        /* enum ctls have a single value in practice */
+        for (i = 0; i < num_values; i++)
+            if (mixer_ctl_set_value(ctl, i, values[i]) < 0)
+                return -1;
+        return 0;
+    default:
+        return -1;
+    }
+}
+
+/*
+ * Parses the value attribute of a ctl: an enum string, or a list of numbers
+ * separated by spaces or commas. Returns the number of values, or -1.
+ */
+static int ctl_parse_values(struct audio_route *ar, unsigned int ctl_index,
+                            const char *string, int *values,
+                            unsigned int max_values)
+{
+    unsigned int num_values = 0;
+    char *end;
+    long value;
+
+    if (mixer_ctl_get_type(ar->mixer_state[ctl_index].ctl) ==
+            MIXER_CTL_TYPE_ENUM) {
+        values[0] = ctl_index_enum_value(ar->ctl_index, ctl_index, string);
+        return values[0] < 0 ? -1 : 1;
+    }
+
+    for (;;) {
+        while (isspace((unsigned char)*string) || *string == ',')
+            string++;
+        if (*string == '\0')
+            break;
+        if (num_values == max_values)
+            return -1;
+        value = strtol(string, &end, 0);
+        if (end == string)
+            return -1;
+        values[num_values++] = value;
+        string = end;
+    }
+
+    return num_values ? (int)num_values : -1;
+}
+
 /* path functions */
 
+static void path_free_settings(struct mixer_path *path)
+{
+    unsigned int i;
+
+    for (i = 0; i < path->length; i++)
+        free(path->setting[i].value);
+    free(path->setting);
+    path->setting = NULL;
+}
+
 static void path_free(struct audio_route *ar)
 {
     unsigned int i;
@@ -80,13 +504,41 @@ static void path_free(struct audio_route *ar)
     for (i = 0; i < ar->num_mixer_paths; i++) {
         if (ar->mixer_path[i].name)
             free(ar->mixer_path[i].name);
-        if (ar->mixer_path[i].setting)
-            free(ar->mixer_path[i].setting);
+        path_free_settings(&ar->mixer_path[i]);
     }
     free(ar->mixer_path);
     ar->mixer_path = NULL;
     ar->mixer_path_size = 0;
     ar->num_mixer_paths = 0;
+    free(ar->path_hash);
+    ar->path_hash = NULL;
+    path_free_settings(&ar->init_path);
+    memset(&ar->init_path, 0, sizeof(ar->init_path));
+}
+
+/* rehashes all paths into a bucket array of size entries, a power of two */
+static int path_hash_rebuild(struct audio_route *ar, unsigned int size)
+{
+    unsigned int *new_path_hash;
+    unsigned int mask = size - 1;
+    unsigned int bucket;
+    unsigned int i;
+
+    new_path_hash = realloc(ar->path_hash, size * sizeof(unsigned int));
+    if (new_path_hash == NULL)
+        return -1;
+    ar->path_hash = new_path_hash;
+
+    for (i = 0; i < size; i++)
+        ar->path_hash[i] = PATH_INDEX_NONE;
+
+    for (i = 0; i < ar->num_mixer_paths; i++) {
+        bucket = name_hash(ar->mixer_path[i].name) & mask;
+        ar->mixer_path[i].next = ar->path_hash[bucket];
+        ar->path_hash[bucket] = i;
+    }
+
+    return 0;
 }
 
 static struct mixer_path *path_get_by_name(struct audio_route *ar,
@@ -94,9 +546,15 @@ static struct mixer_path *path_get_by_name(struct audio_route *ar,
 {
     unsigned int i;
 
-    for (i = 0; i < ar->num_mixer_paths; i++)
+    if (ar->path_hash == NULL)
+        return NULL;
+
+    i = ar->path_hash[name_hash(name) & (ar->mixer_path_size - 1)];
+    while (i != PATH_INDEX_NONE) {
         if (strcmp(ar->mixer_path[i].name, name) == 0)
             return &ar->mixer_path[i];
+        i = ar->mixer_path[i].next;
+    }
 
     return NULL;
 }
@@ -104,6 +562,9 @@ static struct mixer_path *path_get_by_name(struct audio_route *ar,
 static struct mixer_path *path_create(struct audio_route *ar, const char *name)
 {
     struct mixer_path *new_mixer_path = NULL;
+    struct mixer_path *path;
+    unsigned int bucket;
+    unsigned int size;
 
     if (!ar) {
         ALOGE("invalid audio_route");
@@ -118,54 +579,74 @@ static struct mixer_path *path_create(struct audio_route *ar, const char *name)
     /* check if we need to allocate more space for mixer paths */
     if (ar->mixer_path_size <= ar->num_mixer_paths) {
         if (ar->mixer_path_size == 0)
-            ar->mixer_path_size = INITIAL_MIXER_PATH_SIZE;
+            size = INITIAL_MIXER_PATH_SIZE;
         else
-            ar->mixer_path_size *= 2;
+            size = ar->mixer_path_size * 2;
 
-        new_mixer_path = realloc(ar->mixer_path, ar->mixer_path_size *
-                                 sizeof(struct mixer_path));
+        new_mixer_path = realloc(ar->mixer_path,
+                                 size * sizeof(struct mixer_path));
         if (new_mixer_path == NULL) {
             ALOGE("Unable to allocate more paths");
             return NULL;
         } else {
             ar->mixer_path = new_mixer_path;
         }
+
+        /* the bucket array grows with the path array, the lookups only
+           use the new size once both are allocated */
+        if (path_hash_rebuild(ar, size) < 0) {
+            ALOGE("Unable to allocate path hash");
+            return NULL;
+        }
+        ar->mixer_path_size = size;
     }
 
     /* initialise the new mixer path */
-    ar->mixer_path[ar->num_mixer_paths].name = strdup(name);
-    if (ar->mixer_path[ar->num_mixer_paths].name == NULL) {
+    path = &ar->mixer_path[ar->num_mixer_paths];
+    path->name = strdup(name);
+    if (path->name == NULL) {
         ALOGE("Unable to allocate more paths");
         return NULL;
     }
-    ar->mixer_path[ar->num_mixer_paths].size = 0;
-    ar->mixer_path[ar->num_mixer_paths].length = 0;
-    ar->mixer_path[ar->num_mixer_paths].setting = NULL;
+    path->size = 0;
+    path->length = 0;
+    path->setting = NULL;
+
+    bucket = name_hash(name) & (ar->mixer_path_size - 1);
+    path->next = ar->path_hash[bucket];
+    ar->path_hash[bucket] = ar->num_mixer_paths;
 
     /* return the mixer path just added, then increment number of them */
-    return &ar->mixer_path[ar->num_mixer_paths++];
+    ar->num_mixer_paths++;
+    return path;
 }
 
+/* true if the path already sets any of the ctl values of the setting */
 static bool path_setting_exists(struct mixer_path *path,
                                 struct mixer_setting *setting)
 {
+    struct mixer_setting *other;
     unsigned int i;
 
-    for (i = 0; i < path->length; i++)
-        if (path->setting[i].ctl == setting->ctl)
+    for (i = 0; i < path->length; i++) {
+        other = &path->setting[i];
+        if (other->ctl_index == setting->ctl_index &&
+                other->id < setting->id + setting->num_values &&
+                setting->id < other->id + other->num_values)
             return true;
+    }
 
     return false;
 }
 
-static int path_add_setting(struct mixer_path *path,
+static int path_add_setting(struct audio_route *ar, struct mixer_path *path,
                             struct mixer_setting *setting)
 {
     struct mixer_setting *new_path_setting;
 
     if (path_setting_exists(path, setting)) {
         ALOGE("Duplicate path setting '%s'",
-              mixer_ctl_get_name(setting->ctl));
+              mixer_ctl_get_name(ar->mixer_state[setting->ctl_index].ctl));
         return -1;
     }
 
@@ -187,69 +668,147 @@ static int path_add_setting(struct mixer_path *path,
     }
 
     /* initialise the new path setting */
-    path->setting[path->length].ctl = setting->ctl;
-    path->setting[path->length].value = setting->value;
+    path->setting[path->length].value = malloc(setting->num_values *
+                                               sizeof(int));
+    if (path->setting[path->length].value == NULL) {
+        ALOGE("Unable to allocate more path settings");
+        return -1;
+    }
+    memcpy(path->setting[path->length].value, setting->value,
+           setting->num_values * sizeof(int));
+    path->setting[path->length].ctl_index = setting->ctl_index;
+    path->setting[path->length].id = setting->id;
+    path->setting[path->length].num_values = setting->num_values;
     path->length++;
 
     return 0;
 }
 
-static int path_add_path(struct mixer_path *path, struct mixer_path *sub_path)
+static int path_add_path(struct audio_route *ar, struct mixer_path *path,
+                         struct mixer_path *sub_path)
 {
     unsigned int i;
 
     for (i = 0; i < sub_path->length; i++)
-        if (path_add_setting(path, &sub_path->setting[i]) < 0)
+        if (path_add_setting(ar, path, &sub_path->setting[i]) < 0)
             return -1;
 
     return 0;
 }
 
-static void path_print(struct mixer_path *path)
+static void path_print(struct audio_route *ar, struct mixer_path *path)
 {
     unsigned int i;
 
     ALOGV("Path: %s, length: %d", path->name, path->length);
     for (i = 0; i < path->length; i++)
-        ALOGV("  %d: %s -> %d", i, mixer_ctl_get_name(path->setting[i].ctl),
-              path->setting[i].value);
+        ALOGV("  %d: %s[%u..%u] -> %d", i,
+              mixer_ctl_get_name(ar->mixer_state[path->setting[i].ctl_index].ctl),
+              path->setting[i].id,
+              path->setting[i].id + path->setting[i].num_values - 1,
+              path->setting[i].value[0]);
+}
+
+/* reads the values of a ctl from the card, they also become its reset values */
+static void mixer_state_load(struct audio_route *ar, unsigned int ctl_index)
+{
+    struct mixer_state *ms = &ar->mixer_state[ctl_index];
+    size_t size = ms->num_values * sizeof(int);
+
+    ms->synced = ctl_read_values(ms->ctl, ms->old_value, ms->num_values) == 0;
+    if (!ms->synced)
+        memset(ms->old_value, 0, size);
+    memcpy(ms->new_value, ms->old_value, size);
+    memcpy(ms->reset_value, ms->old_value, size);
+    ms->loaded = true;
+}
+
+/* sets pending values of a control and queues it for the next commit */
+static void mixer_state_set(struct audio_route *ar, unsigned int ctl_index,
+                            unsigned int id, unsigned int num_values,
+                            const int *values)
+{
+    struct mixer_state *ms = &ar->mixer_state[ctl_index];
+
+    /* the card only has to be read when some values are left unset */
+    if (!ms->loaded) {
+        if (id == 0 && num_values == ms->num_values)
+            ms->loaded = true;
+        else
+            mixer_state_load(ar, ctl_index);
+    }
+
+    memcpy(ms->new_value + id, values, num_values * sizeof(int));
+    if (!ms->dirty) {
+        ms->dirty = true;
+        ar->dirty_ctls[ar->num_dirty_ctls++] = ctl_index;
+    }
 }
 
 static int path_apply(struct audio_route *ar, struct mixer_path *path)
 {
     unsigned int i;
-    unsigned int j;
+    unsigned int ctl_index;
 
+    /* settings hold mixer_state indices, so this is O(path length) */
     for (i = 0; i < path->length; i++) {
-        struct mixer_ctl *ctl = path->setting[i].ctl;
+        ctl_index = path->setting[i].ctl_index;
 
-        /* locate the mixer ctl in the list */
-        for (j = 0; j < ar->num_mixer_ctls; j++) {
-            if (ar->mixer_state[j].ctl == ctl)
-                break;
-        }
+        /* the first time a path sets a ctl, its value on the card is the
+           one to reset to */
+        if (!ar->mixer_state[ctl_index].loaded)
+            mixer_state_load(ar, ctl_index);
+
+        mixer_state_set(ar, ctl_index, path->setting[i].id,
+                        path->setting[i].num_values, path->setting[i].value);
 
-        /* apply the new value */
-        ar->mixer_state[j].new_value = path->setting[i].value;
+        /* remember it so that a reset only has to undo what paths did */
+        if (!ar->mixer_state[ctl_index].applied) {
+            ar->mixer_state[ctl_index].applied = true;
+            ar->applied_ctls[ar->num_applied_ctls++] = ctl_index;
+        }
     }
 
     return 0;
 }
 
-/* mixer helper function */
-static int mixer_enum_string_to_value(struct mixer_ctl *ctl, const char *string)
+/* records a top level ctl, a later setting of the same values replaces it */
+static int init_path_set(struct audio_route *ar, struct mixer_setting *setting)
 {
+    struct mixer_setting *other;
     unsigned int i;
-    char *enum_string = NULL;
 
-    /* Search the enum strings for a particular one */
-    for (i = 0; i < mixer_ctl_get_num_enums(ctl); i++) {
-        enum_string = mixer_ctl_get_enum_string(ctl, i);
-        if (enum_string != NULL && (strcmp(enum_string, string) == 0))
-            break;
+    for (i = 0; i < ar->init_path.length; i++) {
+        other = &ar->init_path.setting[i];
+        if (other->ctl_index == setting->ctl_index &&
+                other->id == setting->id &&
+                other->num_values == setting->num_values) {
+            memcpy(other->value, setting->value,
+                   setting->num_values * sizeof(int));
+            return 0;
+        }
+    }
+
+    return path_add_setting(ar, &ar->init_path, setting);
+}
+
+/* applies the top level ctls of the xml, which are also the reset values */
+static void init_path_apply(struct audio_route *ar)
+{
+    struct mixer_setting *setting;
+    struct mixer_state *ms;
+    unsigned int i;
+
+    for (i = 0; i < ar->init_path.length; i++) {
+        setting = &ar->init_path.setting[i];
+        mixer_state_set(ar, setting->ctl_index, setting->id,
+                        setting->num_values, setting->value);
     }
 
-    return i;
+    for (i = 0; i < ar->init_path.length; i++) {
+        ms = &ar->mixer_state[ar->init_path.setting[i].ctl_index];
+        memcpy(ms->reset_value, ms->new_value, ms->num_values * sizeof(int));
+    }
 }
 
 static void start_tag(void *data, const XML_Char *tag_name,
@@ -257,20 +816,26 @@ static void start_tag(void *data, const XML_Char *tag_name,
 {
     const XML_Char *attr_name = NULL;
     const XML_Char *attr_value = NULL;
+    const XML_Char *attr_id = NULL;
     struct config_parse_state *state = data;
     struct audio_route *ar = state->ar;
     unsigned int i;
-    struct mixer_ctl *ctl;
-    int value = 0;
+    int ctl_index;
+    unsigned int ctl_num_values;
+    unsigned int id = 0;
+    int num_values;
+    int values[MAX_CTL_VALUES];
     struct mixer_setting mixer_setting;
     struct mixer_path *new_mixer_path = NULL;
 
-    /* Get name, type and value attributes (these may be empty) */
+    /* Get name, id and value attributes (these may be empty) */
     for (i = 0; attr[i]; i += 2) {
         if (strcmp(attr[i], "name") == 0)
             attr_name = attr[i + 1];
         else if (strcmp(attr[i], "value") == 0)
             attr_value = attr[i + 1];
+        else if (strcmp(attr[i], "id") == 0)
+            attr_id = attr[i + 1];
     }
 
     /* Look at tags */
@@ -286,8 +851,8 @@ static void start_tag(void *data, const XML_Char *tag_name,
             } else {
                 /* nested path */
                 struct mixer_path *sub_path = path_get_by_name(ar, attr_name);
-                if (sub_path != NULL)
-                    path_add_path(state->path, sub_path);
+                if (sub_path != NULL && state->path != NULL)
+                    path_add_path(ar, state->path, sub_path);
             }
         }
     }
@@ -297,44 +862,63 @@ static void start_tag(void *data, const XML_Char *tag_name,
             ALOGE("Unnamed ctl!");
         } else {
             /* Obtain the mixer ctl and value */
-            ctl = mixer_get_ctl_by_name(ar->mixer, attr_name);
-            switch (mixer_ctl_get_type(ctl)) {
-            case MIXER_CTL_TYPE_BOOL:
-            case MIXER_CTL_TYPE_INT:
-                if (attr_value != NULL)
-                    value = atoi((char *)attr_value);
-                break;
-            case MIXER_CTL_TYPE_ENUM:
-                if (attr_value != NULL)
-                    value = mixer_enum_string_to_value(ctl, (char *)attr_value);
-                break;
-            default:
-                value = 0;
-                break;
+            ctl_index = ctl_index_find(ar->ctl_index, attr_name);
+            if (ctl_index < 0) {
+                ALOGE("Control '%s' doesn't exist - skipping", attr_name);
+                goto done;
+            }
+            ctl_num_values = ar->mixer_state[ctl_index].num_values;
+            if (ctl_num_values == 0) {
+                ALOGE("Control '%s' has an unsupported type - skipping",
+                      attr_name);
+                goto done;
             }
 
-            if (state->level == 1) {
-                /* top level ctl (initial setting) */
-
-                /* locate the mixer ctl in the list */
-                for (i = 0; i < ar->num_mixer_ctls; i++) {
-                    if (ar->mixer_state[i].ctl == ctl)
-                        break;
+            /* an id selects the first value (channel or byte) to set */
+            if (attr_id != NULL) {
+                id = atoi((char *)attr_id);
+                if (id >= ctl_num_values) {
+                    ALOGE("Control '%s' has no value %u - skipping",
+                          attr_name, id);
+                    goto done;
                 }
+            }
 
-                if (i < ar->num_mixer_ctls) {
-                    /* apply the new value */
-                    ar->mixer_state[i].new_value = value;
+            if (attr_value != NULL) {
+                num_values = ctl_parse_values(ar, ctl_index, attr_value,
+                                              values, ctl_num_values - id);
+                if (num_values < 0) {
+                    ALOGE("Invalid value '%s' for '%s' - skipping",
+                          attr_value, attr_name);
+                    goto done;
                 }
             } else {
+                values[0] = 0;
+                num_values = 1;
+            }
+
+            /* a single value without an id is set on all values */
+            if (attr_id == NULL && num_values == 1) {
+                for (i = 1; i < ctl_num_values; i++)
+                    values[i] = values[0];
+                num_values = ctl_num_values;
+            }
+
+            mixer_setting.ctl_index = ctl_index;
+            mixer_setting.id = id;
+            mixer_setting.num_values = num_values;
+            mixer_setting.value = values;
+            if (state->level == 1) {
+                /* top level ctl (initial setting) */
+                init_path_set(ar, &mixer_setting);
+            } else if (state->path != NULL) {
                 /* nested ctl (within a path) */
-                mixer_setting.ctl = ctl;
-                mixer_setting.value = value;
-                path_add_setting(state->path, &mixer_setting);
+                path_add_setting(ar, state->path, &mixer_setting);
             }
         }
     }
 
+done:
     state->level++;
 }
 
@@ -345,67 +929,176 @@ static void end_tag(void *data, const XML_Char *tag_name)
     state->level--;
 }
 
+static void free_mixer_state(struct audio_route *ar)
+{
+    free(ar->mixer_state);
+    ar->mixer_state = NULL;
+    free(ar->mixer_values);
+    ar->mixer_values = NULL;
+    free(ar->dirty_ctls);
+    ar->dirty_ctls = NULL;
+    free(ar->applied_ctls);
+    ar->applied_ctls = NULL;
+}
+
 static int alloc_mixer_state(struct audio_route *ar)
 {
     unsigned int i;
+    unsigned int num_values = 0;
+    struct mixer_state *ms;
 
     ar->num_mixer_ctls = mixer_get_num_ctls(ar->mixer);
-    ar->mixer_state = malloc(ar->num_mixer_ctls * sizeof(struct mixer_state));
-    if (!ar->mixer_state)
+    ar->mixer_state = calloc(ar->num_mixer_ctls, sizeof(struct mixer_state));
+    ar->dirty_ctls = malloc(ar->num_mixer_ctls * sizeof(unsigned int));
+    ar->applied_ctls = malloc(ar->num_mixer_ctls * sizeof(unsigned int));
+    if (!ar->mixer_state || !ar->dirty_ctls || !ar->applied_ctls) {
+        free_mixer_state(ar);
         return -1;
+    }
+    ar->num_dirty_ctls = 0;
+    ar->num_applied_ctls = 0;
 
     for (i = 0; i < ar->num_mixer_ctls; i++) {
         ar->mixer_state[i].ctl = mixer_get_ctl(ar->mixer, i);
-        /* only get value 0, assume multiple ctl values are the same */
-        ar->mixer_state[i].old_value = mixer_ctl_get_value(ar->mixer_state[i].ctl, 0);
-        ar->mixer_state[i].new_value = ar->mixer_state[i].old_value;
+        ar->mixer_state[i].num_values = ctl_num_values(ar->mixer_state[i].ctl);
+        num_values += ar->mixer_state[i].num_values;
     }
 
-    return 0;
-}
+    /* old, new and reset values of every ctl */
+    ar->mixer_values = malloc(3 * num_values * sizeof(int) + 1);
+    if (!ar->mixer_values) {
+        free_mixer_state(ar);
+        return -1;
+    }
 
-static void free_mixer_state(struct audio_route *ar)
-{
-    free(ar->mixer_state);
-    ar->mixer_state = NULL;
+    /* nothing is read from the card here, see mixer_state_load() */
+    num_values = 0;
+    for (i = 0; i < ar->num_mixer_ctls; i++) {
+        ms = &ar->mixer_state[i];
+        ms->old_value = ar->mixer_values + num_values;
+        ms->new_value = ms->old_value + ms->num_values;
+        ms->reset_value = ms->new_value + ms->num_values;
+        num_values += 3 * ms->num_values;
+    }
+
+    return 0;
 }
 
 void update_mixer_state(struct audio_route *ar)
 {
     unsigned int i;
-    unsigned int j;
-
-    for (i = 0; i < ar->num_mixer_ctls; i++) {
-        /* if the value has changed, update the mixer */
-        if (ar->mixer_state[i].old_value != ar->mixer_state[i].new_value) {
-            /* set all ctl values the same */
-            for (j = 0; j < mixer_ctl_get_num_values(ar->mixer_state[i].ctl); j++)
-                mixer_ctl_set_value(ar->mixer_state[i].ctl, j,
-                                    ar->mixer_state[i].new_value);
-            ar->mixer_state[i].old_value = ar->mixer_state[i].new_value;
+    unsigned int written = 0;
+    struct mixer_state *ms;
+    size_t size;
+
+    /* only controls touched since the last commit can have changed */
+    for (i = 0; i < ar->num_dirty_ctls; i++) {
+        ms = &ar->mixer_state[ar->dirty_ctls[i]];
+        ms->dirty = false;
+        size = ms->num_values * sizeof(int);
+
+        /* if any value has changed, write all of them at once; values
+           that were never read are written unconditionally */
+        if (!ms->synced || memcmp(ms->old_value, ms->new_value, size) != 0) {
+            if (ctl_write_values(ms->ctl, ms->new_value, ms->num_values) < 0)
+                ALOGE("Unable to write control '%s'",
+                      mixer_ctl_get_name(ms->ctl));
+            memcpy(ms->old_value, ms->new_value, size);
+            ms->synced = true;
+            written++;
         }
     }
+
+    ar->stats.ctls_scanned = ar->num_dirty_ctls;
+    ar->stats.ctls_written = written;
+    ar->stats.total_scanned += ar->num_dirty_ctls;
+    ar->stats.total_written += written;
+    ar->stats.commits++;
+
+    ar->num_dirty_ctls = 0;
 }
 
-/* saves the current state of the mixer, for resetting all controls */
-static void save_mixer_state(struct audio_route *ar)
+/* this resets all mixer settings to the saved values */
+static void mixer_state_reset(struct audio_route *ar)
 {
     unsigned int i;
-
-    for (i = 0; i < ar->num_mixer_ctls; i++) {
-        /* only get value 0, assume multiple ctl values are the same */
-        ar->mixer_state[i].reset_value = mixer_ctl_get_value(ar->mixer_state[i].ctl, 0);
+    struct mixer_state *ms;
+
+    /* only controls set by a path can differ from their saved values */
+    for (i = 0; i < ar->num_applied_ctls; i++) {
+        ms = &ar->mixer_state[ar->applied_ctls[i]];
+        ms->applied = false;
+        mixer_state_set(ar, ar->applied_ctls[i], 0, ms->num_values,
+                        ms->reset_value);
     }
+    ar->num_applied_ctls = 0;
 }
 
-/* this resets all mixer settings to the saved values */
 void reset_mixer_state(struct audio_route *ar)
 {
-    unsigned int i;
+    ar->current_route = ROUTE_NONE;
+    mixer_state_reset(ar);
+}
+
+void audio_route_get_stats(struct audio_route *ar,
+                           struct audio_route_stats *stats)
+{
+    *stats = ar->stats;
+}
+
+/* xml reload functions */
+
+static void route_memo_flush(struct audio_route *ar);
+
+static void path_tables_swap(struct audio_route *a, struct audio_route *b)
+{
+    struct audio_route tmp;
+
+    tmp.mixer_path_size = a->mixer_path_size;
+    tmp.num_mixer_paths = a->num_mixer_paths;
+    tmp.mixer_path = a->mixer_path;
+    tmp.path_hash = a->path_hash;
+    tmp.init_path = a->init_path;
+
+    a->mixer_path_size = b->mixer_path_size;
+    a->num_mixer_paths = b->num_mixer_paths;
+    a->mixer_path = b->mixer_path;
+    a->path_hash = b->path_hash;
+    a->init_path = b->init_path;
+
+    b->mixer_path_size = tmp.mixer_path_size;
+    b->num_mixer_paths = tmp.num_mixer_paths;
+    b->mixer_path = tmp.mixer_path;
+    b->path_hash = tmp.path_hash;
+    b->init_path = tmp.init_path;
+}
+
+/* swaps in the path tables of a reloaded xml, if there are any */
+static void route_reload_update(struct audio_route *ar)
+{
+    struct audio_route *pending;
+
+    if (!ar->reload_watching)
+        return;
+
+    pthread_mutex_lock(&ar->reload_lock);
+    pending = ar->reload_pending;
+    ar->reload_pending = NULL;
+    pthread_mutex_unlock(&ar->reload_lock);
+
+    if (!pending)
+        return;
 
-    /* load all of the saved values */
-    for (i = 0; i < ar->num_mixer_ctls; i++)
-        ar->mixer_state[i].new_value = ar->mixer_state[i].reset_value;
+    /* undo the old paths before their settings go away, then apply the new
+       initial values, which are also the new reset values */
+    mixer_state_reset(ar);
+    path_tables_swap(ar, pending);
+    init_path_apply(ar);
+    route_memo_flush(ar);
+
+    path_free(pending);
+    free(pending);
+    ALOGV("Mixer paths reloaded from %s", ar->xml_path);
 }
 
 void audio_route_apply_path(struct audio_route *ar, const char *name)
@@ -417,120 +1110,1061 @@ void audio_route_apply_path(struct audio_route *ar, const char *name)
         return;
     }
 
+    route_reload_update(ar);
+
     path = path_get_by_name(ar, name);
     if (!path) {
         ALOGE("unable to find path '%s'", name);
         return;
     }
 
+    ar->current_route = ROUTE_NONE;
     path_apply(ar, path);
 }
 
-int audio_route_control_set_number(unsigned int card_slot, char *control_name,
-                                   char *string)
+/* route memo functions */
+
+static void route_memo_flush(struct audio_route *ar)
 {
-    struct mixer *control_mixer;
-    struct mixer_ctl *ctl;
-    const char *name;
-    unsigned int num_ctls, num_values;
-    unsigned int i, j;
-    enum mixer_ctl_type type;
-    int value;
-    int ret, mixer_ret;
+    unsigned int i;
 
-    control_mixer = mixer_open(card_slot);
-    if (!control_mixer) {
-        ALOGE("Unable to open the control mixer, aborting.");
-        return -1;
+    for (i = 0; i < ar->num_routes; i++) {
+        free(ar->route[i].paths);
+        free(ar->route[i].ctls);
+        free(ar->route[i].values);
     }
-    ALOGV("Control mixer open successful.");
-
-    num_ctls = mixer_get_num_ctls(control_mixer);
-
-    ret = 0;
-    for (i = 0; i < num_ctls; i++) {
-        ctl = mixer_get_ctl(control_mixer, i);
-        name = mixer_ctl_get_name(ctl);
-        if (name && strcmp(name, control_name) == 0) {
-            /* Found the control, update and exit */
-            value = atoi(string);
-            num_values = mixer_ctl_get_num_values(ctl);
-            for (j = 0; j < num_values; j++) {
-                mixer_ret = mixer_ctl_set_value(ctl, j, value);
-                if (mixer_ret) {
-                    ALOGE("Error: invalid value (%s to %d)", name, value);
-                    mixer_close(control_mixer);
-                    /* Add up the number of failed controller values */
-                    ret += -1;
-                }
-            }
-            if (ret == 0)
-                ALOGV("Setting %s to int %d", name, value);
-            break;
-        }
+    for (i = 0; i < ar->num_deltas; i++) {
+        free(ar->delta[i].ctls);
+        free(ar->delta[i].values);
     }
 
-    return ret;
+    ar->num_routes = 0;
+    ar->num_deltas = 0;
+    ar->next_delta = 0;
+    ar->current_route = ROUTE_NONE;
 }
 
-int audio_route_control_set_enum(unsigned int card_slot, char *control_name,
-                                 char *string)
+static unsigned int route_memo_find(struct audio_route *ar,
+                                    const unsigned int *paths,
+                                    unsigned int num_paths)
 {
-    struct mixer *control_mixer;
-    struct mixer_ctl *ctl;
-    const char *name;
-    unsigned int num_ctls, num_values;
-    unsigned int i, j;
-    enum mixer_ctl_type type;
-    int value;
-    int ret, mixer_ret;
+    unsigned int i;
 
-    control_mixer = mixer_open(card_slot);
-    if (!control_mixer) {
-        ALOGE("Unable to open the control mixer, aborting.");
-        return -1;
+    for (i = 0; i < ar->num_routes; i++) {
+        if (ar->route[i].num_paths == num_paths &&
+                memcmp(ar->route[i].paths, paths,
+                       num_paths * sizeof(unsigned int)) == 0)
+            return i;
     }
-    ALOGV("Control mixer open successful.");
 
-    num_ctls = mixer_get_num_ctls(control_mixer);
+    return ROUTE_NONE;
+}
 
-    ret = 0;
-    for (i = 0; i < num_ctls; i++) {
-        ctl = mixer_get_ctl(control_mixer, i);
-        name = mixer_ctl_get_name(ctl);
-        if (name && strcmp(name, control_name) == 0) {
-            /* Found the control, update and exit */
-            type = mixer_ctl_get_type(ctl);
-            if (type == MIXER_CTL_TYPE_ENUM) {
-                if (mixer_ctl_set_enum_by_string(ctl, string)) {
-                    ALOGE("Error: invalid enum value");
-                    ret = -1;
-                } else {
-                    ALOGV("Setting %s to string %s", name, string);
-                }
-            } else {
-                ALOGV("Error: only enum types can be set with strings");
-                ret = -1;
-            }
-            break;
+static int compare_uint(const void *a, const void *b)
+{
+    unsigned int x = *(const unsigned int *)a;
+    unsigned int y = *(const unsigned int *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/* memoizes the ctls set by the paths just applied, returns the route index */
+static unsigned int route_memo_add(struct audio_route *ar,
+                                   const unsigned int *paths,
+                                   unsigned int num_paths)
+{
+    struct route_memo *route;
+    struct mixer_state *ms;
+    unsigned int num_values = 0;
+    unsigned int i;
+    int *value;
+
+    /* the set of routes is expected to be small, start over if it isn't */
+    if (ar->num_routes == ROUTE_MEMO_MAX_ROUTES)
+        route_memo_flush(ar);
+
+    route = &ar->route[ar->num_routes];
+    route->num_paths = num_paths;
+    route->num_ctls = ar->num_applied_ctls;
+    route->paths = malloc(num_paths * sizeof(unsigned int) + 1);
+    route->ctls = malloc(route->num_ctls * sizeof(unsigned int) + 1);
+    for (i = 0; i < ar->num_applied_ctls; i++)
+        num_values += ar->mixer_state[ar->applied_ctls[i]].num_values;
+    route->values = malloc(num_values * sizeof(int) + 1);
+    if (!route->paths || !route->ctls || !route->values) {
+        free(route->paths);
+        free(route->ctls);
+        free(route->values);
+        return ROUTE_NONE;
+    }
+
+    memcpy(route->paths, paths, num_paths * sizeof(unsigned int));
+    memcpy(route->ctls, ar->applied_ctls,
+           route->num_ctls * sizeof(unsigned int));
+    qsort(route->ctls, route->num_ctls, sizeof(unsigned int), compare_uint);
+
+    value = route->values;
+    for (i = 0; i < route->num_ctls; i++) {
+        ms = &ar->mixer_state[route->ctls[i]];
+        memcpy(value, ms->new_value, ms->num_values * sizeof(int));
+        value += ms->num_values;
+    }
+
+    return ar->num_routes++;
+}
+
+/* adds a ctl to the delta if its value differs between the two routes */
+static void route_delta_add(struct route_delta *delta, unsigned int ctl_index,
+                            unsigned int num_values, int **value,
+                            const int *from_value, const int *to_value)
+{
+    if (memcmp(from_value, to_value, num_values * sizeof(int)) == 0)
+        return;
+
+    delta->ctls[delta->num_ctls++] = ctl_index;
+    memcpy(*value, to_value, num_values * sizeof(int));
+    *value += num_values;
+}
+
+/* returns the delta between two memoized routes, computing it if needed */
+static struct route_delta *route_delta_get(struct audio_route *ar,
+                                           unsigned int from, unsigned int to)
+{
+    struct route_memo *a = &ar->route[from];
+    struct route_memo *b = &ar->route[to];
+    struct route_delta *delta;
+    struct mixer_state *ms;
+    const int *a_value = a->values;
+    const int *b_value = b->values;
+    unsigned int num_values = 0;
+    unsigned int ctl_index;
+    unsigned int i, j = 0;
+    int *value;
+
+    for (i = 0; i < ar->num_deltas; i++) {
+        if (ar->delta[i].from == from && ar->delta[i].to == to)
+            return &ar->delta[i];
+    }
+
+    /* reuse the oldest delta once the table is full */
+    if (ar->num_deltas < ROUTE_MEMO_MAX_DELTAS) {
+        delta = &ar->delta[ar->num_deltas++];
+    } else {
+        delta = &ar->delta[ar->next_delta];
+        ar->next_delta = (ar->next_delta + 1) % ROUTE_MEMO_MAX_DELTAS;
+        free(delta->ctls);
+        free(delta->values);
+    }
+
+    for (i = 0; i < a->num_ctls; i++)
+        num_values += ar->mixer_state[a->ctls[i]].num_values;
+    for (i = 0; i < b->num_ctls; i++)
+        num_values += ar->mixer_state[b->ctls[i]].num_values;
+
+    delta->from = from;
+    delta->to = to;
+    delta->num_ctls = 0;
+    delta->ctls = malloc((a->num_ctls + b->num_ctls) * sizeof(unsigned int) + 1);
+    delta->values = malloc(num_values * sizeof(int) + 1);
+    if (!delta->ctls || !delta->values) {
+        free(delta->ctls);
+        free(delta->values);
+        delta->ctls = NULL;
+        delta->values = NULL;
+        delta->from = ROUTE_NONE;
+        delta->to = ROUTE_NONE;
+        return NULL;
+    }
+
+    /* merge the sorted ctl lists, ctls only set by one of the routes are
+       at their reset value in the other */
+    value = delta->values;
+    i = 0;
+    while (i < a->num_ctls || j < b->num_ctls) {
+        if (j == b->num_ctls ||
+                (i < a->num_ctls && a->ctls[i] < b->ctls[j])) {
+            ctl_index = a->ctls[i++];
+            ms = &ar->mixer_state[ctl_index];
+            route_delta_add(delta, ctl_index, ms->num_values, &value,
+                            a_value, ms->reset_value);
+            a_value += ms->num_values;
+        } else if (i == a->num_ctls || b->ctls[j] < a->ctls[i]) {
+            ctl_index = b->ctls[j++];
+            ms = &ar->mixer_state[ctl_index];
+            route_delta_add(delta, ctl_index, ms->num_values, &value,
+                            ms->reset_value, b_value);
+            b_value += ms->num_values;
+        } else {
+            ctl_index = a->ctls[i++];
+            j++;
+            ms = &ar->mixer_state[ctl_index];
+            route_delta_add(delta, ctl_index, ms->num_values, &value,
+                            a_value, b_value);
+            a_value += ms->num_values;
+            b_value += ms->num_values;
         }
     }
 
-    mixer_close(control_mixer);
+    return delta;
+}
+
+/* writes a delta to the card, the mixer must be on the route it starts from */
+static void route_delta_apply(struct audio_route *ar,
+                              const struct route_delta *delta)
+{
+    struct route_memo *route = &ar->route[delta->to];
+    struct mixer_state *ms;
+    const int *value = delta->values;
+    unsigned int i;
+    size_t size;
+
+    for (i = 0; i < delta->num_ctls; i++) {
+        ms = &ar->mixer_state[delta->ctls[i]];
+        size = ms->num_values * sizeof(int);
+        if (ctl_write_values(ms->ctl, value, ms->num_values) < 0)
+            ALOGE("Unable to write control '%s'", mixer_ctl_get_name(ms->ctl));
+        memcpy(ms->old_value, value, size);
+        memcpy(ms->new_value, value, size);
+        ms->synced = true;
+        value += ms->num_values;
+    }
+
+    /* the ctls of the new route are the ones a reset has to restore */
+    for (i = 0; i < ar->num_applied_ctls; i++)
+        ar->mixer_state[ar->applied_ctls[i]].applied = false;
+    for (i = 0; i < route->num_ctls; i++) {
+        ar->applied_ctls[i] = route->ctls[i];
+        ar->mixer_state[route->ctls[i]].applied = true;
+    }
+    ar->num_applied_ctls = route->num_ctls;
+
+    ar->stats.ctls_scanned = delta->num_ctls;
+    ar->stats.ctls_written = delta->num_ctls;
+    ar->stats.total_scanned += delta->num_ctls;
+    ar->stats.total_written += delta->num_ctls;
+    ar->stats.commits++;
+    ar->stats.route_hits++;
+}
+
+int audio_route_apply_route(struct audio_route *ar,
+                            const char * const *names, unsigned int num_names)
+{
+    struct mixer_path *path;
+    struct route_delta *delta = NULL;
+    unsigned int *paths;
+    unsigned int num_paths = 0;
+    unsigned int route;
+    unsigned int i;
+
+    if (!ar) {
+        ALOGE("invalid audio_route");
+        return -1;
+    }
+
+    route_reload_update(ar);
+
+    paths = malloc(num_names * sizeof(unsigned int) + 1);
+    if (!paths)
+        return -1;
+
+    for (i = 0; i < num_names; i++) {
+        path = path_get_by_name(ar, names[i]);
+        if (!path) {
+            ALOGE("unable to find path '%s'", names[i]);
+            continue;
+        }
+        paths[num_paths++] = path - ar->mixer_path;
+    }
+
+    /* a route seen before is one batch of writes away, as long as the
+       mixer is still on the route it was left on */
+    route = route_memo_find(ar, paths, num_paths);
+    if (route != ROUTE_NONE && route == ar->current_route &&
+            ar->num_dirty_ctls == 0) {
+        free(paths);
+        return 0;
+    }
+    if (route != ROUTE_NONE && ar->current_route != ROUTE_NONE &&
+            ar->num_dirty_ctls == 0)
+        delta = route_delta_get(ar, ar->current_route, route);
+
+    if (delta) {
+        route_delta_apply(ar, delta);
+    } else {
+        mixer_state_reset(ar);
+        for (i = 0; i < num_paths; i++)
+            path_apply(ar, &ar->mixer_path[paths[i]]);
+        if (route == ROUTE_NONE)
+            route = route_memo_add(ar, paths, num_paths);
+        update_mixer_state(ar);
+    }
+
+    ar->current_route = route;
+    free(paths);
+    return 0;
+}
+
+/*
+ * Mixers opened by audio_route_control_set_*(), kept open per card so that
+ * setting a control only costs the write itself.
+ */
+static pthread_mutex_t control_mixer_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct mixer_ctl_index *control_mixer[CONTROL_MIXER_MAX_CARDS];
+
+/* must be called with control_mixer_lock held */
+static struct mixer_ctl_index *control_mixer_get(unsigned int card_slot)
+{
+    struct mixer *mixer;
+
+    if (card_slot >= CONTROL_MIXER_MAX_CARDS) {
+        ALOGE("Invalid control card %u", card_slot);
+        return NULL;
+    }
+
+    if (control_mixer[card_slot])
+        return control_mixer[card_slot];
+
+    mixer = mixer_open(card_slot);
+    if (!mixer) {
+        ALOGE("Unable to open the control mixer, aborting.");
+        return NULL;
+    }
+    ALOGV("Control mixer open successful.");
+
+    control_mixer[card_slot] = ctl_index_create(mixer);
+    if (!control_mixer[card_slot])
+        mixer_close(mixer);
+
+    return control_mixer[card_slot];
+}
+
+/* must be called with control_mixer_lock held */
+static void control_mixer_drop(unsigned int card_slot)
+{
+    struct mixer_ctl_index *index;
+
+    if (card_slot >= CONTROL_MIXER_MAX_CARDS || !control_mixer[card_slot])
+        return;
+
+    index = control_mixer[card_slot];
+    control_mixer[card_slot] = NULL;
+    mixer_close(index->mixer);
+    ctl_index_free(index);
+}
+
+/* sets every value of a ctl to the same value with a single write */
+static int ctl_set_all_values(struct mixer_ctl *ctl, int value)
+{
+    int values[MAX_CTL_VALUES];
+    unsigned int num_values = ctl_num_values(ctl);
+    unsigned int i;
+
+    for (i = 0; i < num_values; i++)
+        values[i] = value;
+
+    return ctl_write_values(ctl, values, num_values);
+}
+
+/*
+ * Sets a ctl of a cached control mixer. Numbers are only accepted for int
+ * and bool ctls and strings only for enum ctls, unless either is allowed.
+ * Returns -ENODEV if the card went away and the mixer must be reopened.
+ */
+static int control_set(struct mixer_ctl_index *index, const char *control_name,
+                       const char *string, bool number, bool enumerated)
+{
+    struct mixer_ctl *ctl;
+    int ctl_num;
+    int value;
+    int ret;
+
+    ctl_num = ctl_index_find(index, control_name);
+    if (ctl_num < 0) {
+        ALOGE("Control '%s' doesn't exist", control_name);
+        return -EINVAL;
+    }
+
+    ctl = mixer_get_ctl(index->mixer, ctl_num);
+    switch (mixer_ctl_get_type(ctl)) {
+    case MIXER_CTL_TYPE_BOOL:
+    case MIXER_CTL_TYPE_INT:
+        if (!number) {
+            ALOGV("Error: only enum types can be set with strings");
+            return -EINVAL;
+        }
+        value = atoi(string);
+        ret = ctl_set_all_values(ctl, value);
+        if (ret == 0)
+            ALOGV("Setting %s to int %d", control_name, value);
+        break;
+    case MIXER_CTL_TYPE_ENUM:
+        if (!enumerated) {
+            ALOGE("Error: %s is not a number control", control_name);
+            return -EINVAL;
+        }
+        value = ctl_index_enum_value(index, ctl_num, string);
+        if (value < 0) {
+            ALOGE("Error: invalid enum value");
+            return -EINVAL;
+        }
+        ret = ctl_set_all_values(ctl, value);
+        if (ret == 0)
+            ALOGV("Setting %s to string %s", control_name, string);
+        break;
+    default:
+        ALOGE("Error: unsupported type of control %s", control_name);
+        return -EINVAL;
+    }
+
+    if (ret < 0 && (errno == ENODEV || errno == EBADF))
+        return -ENODEV;
+    if (ret < 0)
+        ALOGE("Error: invalid value (%s to %s)", control_name, string);
+
+    return ret < 0 ? -EINVAL : 0;
+}
+
+/* sets the controls on a card, reopening its mixer once if it went away */
+static int control_set_batch(unsigned int card_slot,
+                             const struct audio_route_control *controls,
+                             unsigned int num_controls,
+                             bool number, bool enumerated)
+{
+    struct mixer_ctl_index *index;
+    unsigned int i;
+    bool reopened = false;
+    int failed = 0;
+    int ret;
+
+    pthread_mutex_lock(&control_mixer_lock);
+    index = control_mixer_get(card_slot);
+    for (i = 0; index && i < num_controls; i++) {
+        ret = control_set(index, controls[i].name, controls[i].value,
+                          number, enumerated);
+        if (ret == -ENODEV && !reopened) {
+            /* the card was unplugged, it may be back under the same slot */
+            ALOGW("Control card %u went away, reopening", card_slot);
+            control_mixer_drop(card_slot);
+            index = control_mixer_get(card_slot);
+            reopened = true;
+            i--;
+            continue;
+        }
+        if (ret < 0)
+            failed++;
+    }
+    if (!index)
+        failed = -1;
+    pthread_mutex_unlock(&control_mixer_lock);
+
+    return failed;
+}
+
+int audio_route_control_set_number(unsigned int card_slot, char *control_name,
+                                   char *string)
+{
+    struct audio_route_control control = { control_name, string };
+
+    return control_set_batch(card_slot, &control, 1, true, false) ? -1 : 0;
+}
+
+int audio_route_control_set_enum(unsigned int card_slot, char *control_name,
+                                 char *string)
+{
+    struct audio_route_control control = { control_name, string };
+
+    return control_set_batch(card_slot, &control, 1, false, true) ? -1 : 0;
+}
+
+int audio_route_control_set_batch(unsigned int card_slot,
+                                  const struct audio_route_control *controls,
+                                  unsigned int num_controls)
+{
+    return control_set_batch(card_slot, controls, num_controls, true, true);
+}
+
+void audio_route_control_release(unsigned int card_slot)
+{
+    pthread_mutex_lock(&control_mixer_lock);
+    control_mixer_drop(card_slot);
+    pthread_mutex_unlock(&control_mixer_lock);
+}
+
+/* fingerprint of the card's control list, the cache holds indices into it */
+static uint32_t mixer_ctl_fingerprint(struct audio_route *ar)
+{
+    unsigned int hash = FNV_OFFSET_BASIS;
+    unsigned int i, j;
+    struct mixer_ctl *ctl;
+    const char *string;
+    uint32_t word;
+
+    for (i = 0; i < ar->num_mixer_ctls; i++) {
+        ctl = ar->mixer_state[i].ctl;
+        string = mixer_ctl_get_name(ctl);
+        if (string)
+            hash = fnv_update(hash, string, strlen(string) + 1);
+        word = mixer_ctl_get_type(ctl);
+        hash = fnv_update(hash, &word, sizeof(word));
+        word = mixer_ctl_get_num_values(ctl);
+        hash = fnv_update(hash, &word, sizeof(word));
+        /* enum values are cached as indices into the enum strings */
+        for (j = 0; j < ar->ctl_index->num_enums[i]; j++) {
+            string = ar->ctl_index->enum_strings[i][j];
+            if (string)
+                hash = fnv_update(hash, string, strlen(string) + 1);
+        }
+    }
+
+    return hash;
+}
+
+static bool route_cache_settings_valid(struct audio_route *ar,
+                                       const struct route_cache_setting *setting,
+                                       uint32_t count, uint32_t num_values)
+{
+    uint32_t i;
+    uint32_t ctl_num_values;
+
+    for (i = 0; i < count; i++) {
+        if (setting[i].ctl_index >= ar->num_mixer_ctls)
+            return false;
+        ctl_num_values = ar->mixer_state[setting[i].ctl_index].num_values;
+        if (setting[i].num_values == 0 ||
+                setting[i].id >= ctl_num_values ||
+                setting[i].num_values > ctl_num_values - setting[i].id ||
+                setting[i].first_value > num_values ||
+                setting[i].num_values > num_values - setting[i].first_value)
+            return false;
+    }
+
+    return true;
+}
+
+static void route_cache_setting_get(struct mixer_setting *mixer_setting,
+                                    const struct route_cache_setting *setting,
+                                    const int32_t *values)
+{
+    mixer_setting->ctl_index = setting->ctl_index;
+    mixer_setting->id = setting->id;
+    mixer_setting->num_values = setting->num_values;
+    mixer_setting->value = (int *)(values + setting->first_value);
+}
+
+/* loads the compiled paths from the cache, returns -1 if it can't be used */
+static int route_cache_load(struct audio_route *ar, const char *cache_path,
+                            const struct route_cache_key *key)
+{
+    const struct route_cache_header *header;
+    const struct route_cache_setting *init_setting;
+    const struct route_cache_setting *setting;
+    const struct route_cache_path *cache_path_table;
+    const int32_t *values;
+    const char *strings;
+    struct mixer_path *path;
+    struct mixer_setting mixer_setting;
+    struct stat st;
+    uint64_t expected_size;
+    void *map;
+    uint32_t i, j;
+    int fd;
+    int ret = -1;
+
+    fd = open(cache_path, O_RDONLY);
+    if (fd < 0)
+        return -1;
+
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(*header)) {
+        close(fd);
+        return -1;
+    }
+
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return -1;
+
+    header = map;
+    if (header->magic != ROUTE_CACHE_MAGIC ||
+            header->version != ROUTE_CACHE_VERSION ||
+            memcmp(&header->key, key, sizeof(*key)) != 0) {
+        ALOGV("Mixer path cache %s is stale", cache_path);
+        goto out;
+    }
+
+    /* 64 bit, so that no counts can wrap the sum around to the file size */
+    expected_size = sizeof(*header) +
+            (uint64_t)header->num_init_settings * sizeof(*init_setting) +
+            (uint64_t)header->num_paths * sizeof(*cache_path_table) +
+            (uint64_t)header->num_settings * sizeof(*setting) +
+            (uint64_t)header->num_values * sizeof(*values) +
+            header->strings_size;
+    if (expected_size != (uint64_t)st.st_size || header->strings_size == 0) {
+        ALOGE("Mixer path cache %s is corrupt", cache_path);
+        goto out;
+    }
+
+    init_setting = (const struct route_cache_setting *)(header + 1);
+    cache_path_table = (const struct route_cache_path *)
+            (init_setting + header->num_init_settings);
+    setting = (const struct route_cache_setting *)
+            (cache_path_table + header->num_paths);
+    values = (const int32_t *)(setting + header->num_settings);
+    strings = (const char *)(values + header->num_values);
+
+    if (strings[header->strings_size - 1] != '\0' ||
+            !route_cache_settings_valid(ar, init_setting,
+                                        header->num_init_settings,
+                                        header->num_values) ||
+            !route_cache_settings_valid(ar, setting, header->num_settings,
+                                        header->num_values)) {
+        ALOGE("Mixer path cache %s is corrupt", cache_path);
+        goto out;
+    }
+
+    for (i = 0; i < header->num_init_settings; i++) {
+        route_cache_setting_get(&mixer_setting, &init_setting[i], values);
+        if (init_path_set(ar, &mixer_setting) < 0)
+            goto err_paths;
+    }
+
+    for (i = 0; i < header->num_paths; i++) {
+        if (cache_path_table[i].name_offset >= header->strings_size ||
+                cache_path_table[i].first_setting > header->num_settings ||
+                cache_path_table[i].length >
+                    header->num_settings - cache_path_table[i].first_setting)
+            goto err_paths;
+
+        path = path_create(ar, strings + cache_path_table[i].name_offset);
+        if (path == NULL)
+            goto err_paths;
+
+        for (j = 0; j < cache_path_table[i].length; j++) {
+            route_cache_setting_get(&mixer_setting,
+                    &setting[cache_path_table[i].first_setting + j], values);
+            if (path_add_setting(ar, path, &mixer_setting) < 0)
+                goto err_paths;
+        }
+    }
+
+    ALOGV("Loaded %u mixer paths from %s", header->num_paths, cache_path);
+    ret = 0;
+    goto out;
+
+err_paths:
+    ALOGE("Unable to load mixer path cache %s", cache_path);
+    path_free(ar);
+out:
+    munmap(map, st.st_size);
     return ret;
 }
 
-struct audio_route *audio_route_init(unsigned int card_slot)
+/* writes the setting table of a path, values are numbered from *first_value */
+static int route_cache_write_settings(FILE *file, const struct mixer_path *path,
+                                      uint32_t *first_value)
+{
+    struct route_cache_setting setting;
+    unsigned int i;
+
+    for (i = 0; i < path->length; i++) {
+        setting.ctl_index = path->setting[i].ctl_index;
+        setting.id = path->setting[i].id;
+        setting.num_values = path->setting[i].num_values;
+        setting.first_value = *first_value;
+        if (fwrite(&setting, sizeof(setting), 1, file) != 1)
+            return -1;
+        *first_value += setting.num_values;
+    }
+
+    return 0;
+}
+
+static int route_cache_write_values(FILE *file, const struct mixer_path *path)
+{
+    int32_t value;
+    unsigned int i, j;
+
+    for (i = 0; i < path->length; i++) {
+        for (j = 0; j < path->setting[i].num_values; j++) {
+            value = path->setting[i].value[j];
+            if (fwrite(&value, sizeof(value), 1, file) != 1)
+                return -1;
+        }
+    }
+
+    return 0;
+}
+
+static uint32_t path_num_values(const struct mixer_path *path)
+{
+    uint32_t num_values = 0;
+    unsigned int i;
+
+    for (i = 0; i < path->length; i++)
+        num_values += path->setting[i].num_values;
+
+    return num_values;
+}
+
+/* writes the compiled paths, replacing any previous cache atomically */
+static void route_cache_save(struct audio_route *ar, const char *cache_path,
+                             const struct route_cache_key *key)
+{
+    struct route_cache_header header;
+    struct route_cache_path cache_path_entry;
+    char tmp_path[PATH_MAX];
+    FILE *file;
+    uint32_t first_value = 0;
+    unsigned int i;
+
+    memset(&header, 0, sizeof(header));
+    header.magic = ROUTE_CACHE_MAGIC;
+    header.version = ROUTE_CACHE_VERSION;
+    header.key = *key;
+    header.num_init_settings = ar->init_path.length;
+    header.num_paths = ar->num_mixer_paths;
+    header.num_values = path_num_values(&ar->init_path);
+    for (i = 0; i < ar->num_mixer_paths; i++) {
+        header.num_settings += ar->mixer_path[i].length;
+        header.num_values += path_num_values(&ar->mixer_path[i]);
+        header.strings_size += strlen(ar->mixer_path[i].name) + 1;
+    }
+    /* an empty string table would make a zero sized tail */
+    if (header.strings_size == 0)
+        header.strings_size = 1;
+
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", cache_path);
+    file = fopen(tmp_path, "w");
+    if (!file) {
+        ALOGW("Unable to create mixer path cache %s", tmp_path);
+        return;
+    }
+
+    if (fwrite(&header, sizeof(header), 1, file) != 1 ||
+            route_cache_write_settings(file, &ar->init_path, &first_value) < 0)
+        goto err_write;
+
+    cache_path_entry.name_offset = 0;
+    cache_path_entry.first_setting = 0;
+    for (i = 0; i < ar->num_mixer_paths; i++) {
+        cache_path_entry.length = ar->mixer_path[i].length;
+        if (fwrite(&cache_path_entry, sizeof(cache_path_entry), 1, file) != 1)
+            goto err_write;
+        cache_path_entry.name_offset += strlen(ar->mixer_path[i].name) + 1;
+        cache_path_entry.first_setting += ar->mixer_path[i].length;
+    }
+
+    for (i = 0; i < ar->num_mixer_paths; i++)
+        if (route_cache_write_settings(file, &ar->mixer_path[i],
+                                       &first_value) < 0)
+            goto err_write;
+
+    if (route_cache_write_values(file, &ar->init_path) < 0)
+        goto err_write;
+    for (i = 0; i < ar->num_mixer_paths; i++)
+        if (route_cache_write_values(file, &ar->mixer_path[i]) < 0)
+            goto err_write;
+
+    for (i = 0; i < ar->num_mixer_paths; i++)
+        if (fwrite(ar->mixer_path[i].name,
+                   strlen(ar->mixer_path[i].name) + 1, 1, file) != 1)
+            goto err_write;
+    if (ar->num_mixer_paths == 0 && fputc('\0', file) == EOF)
+        goto err_write;
+
+    if (fclose(file) != 0) {
+        file = NULL;
+        goto err_write;
+    }
+
+    if (rename(tmp_path, cache_path) < 0) {
+        ALOGW("Unable to rename mixer path cache %s", tmp_path);
+        unlink(tmp_path);
+        return;
+    }
+
+    ALOGV("Saved %u mixer paths to %s", ar->num_mixer_paths, cache_path);
+    return;
+
+err_write:
+    ALOGW("Unable to write mixer path cache %s", tmp_path);
+    if (file)
+        fclose(file);
+    unlink(tmp_path);
+}
+
+/* parses the mixer xml into the path tables */
+static int route_parse_xml(struct audio_route *ar, const char *xml_path)
 {
     struct config_parse_state state;
     XML_Parser parser;
     FILE *file;
     int bytes_read;
     void *buf;
+    int ret = -1;
+
+    file = fopen(xml_path, "r");
+    if (!file) {
+        ALOGE("Failed to open %s", xml_path);
+        return -1;
+    }
+
+    parser = XML_ParserCreate(NULL);
+    if (!parser) {
+        ALOGE("Failed to create XML parser");
+        goto err_parser_create;
+    }
+
+    memset(&state, 0, sizeof(state));
+    state.ar = ar;
+    XML_SetUserData(parser, &state);
+    XML_SetElementHandler(parser, start_tag, end_tag);
+
+    for (;;) {
+        buf = XML_GetBuffer(parser, BUF_SIZE);
+        if (buf == NULL)
+            goto err_parse;
+
+        bytes_read = fread(buf, 1, BUF_SIZE, file);
+        if (ferror(file))
+            goto err_parse;
+
+        if (XML_ParseBuffer(parser, bytes_read,
+                            bytes_read == 0) == XML_STATUS_ERROR) {
+            ALOGE("Error in mixer xml (%s)", xml_path);
+            goto err_parse;
+        }
+
+        if (bytes_read == 0)
+            break;
+    }
+
+    ret = 0;
+
+err_parse:
+    XML_ParserFree(parser);
+err_parser_create:
+    fclose(file);
+    return ret;
+}
+
+/* FNV-1a hash of the contents of a file, false if it can't be read */
+static bool file_hash(const char *path, unsigned int *hash)
+{
+    char buf[BUF_SIZE];
+    ssize_t len;
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return false;
+
+    *hash = FNV_OFFSET_BASIS;
+    while ((len = read(fd, buf, sizeof(buf))) > 0)
+        *hash = fnv_update(*hash, buf, len);
+    close(fd);
+
+    return len == 0;
+}
+
+/* returns false if the xml can't be stat'ed or read, there is nothing to
+   key on */
+static bool route_cache_key_get(struct audio_route *ar,
+                                struct route_cache_key *key)
+{
+    struct stat xml_stat;
+    unsigned int xml_hash;
+
+    if (stat(ar->xml_path, &xml_stat) < 0)
+        return false;
+    if (!file_hash(ar->xml_path, &xml_hash))
+        return false;
+
+    memset(key, 0, sizeof(*key));
+    key->xml_mtime = xml_stat.st_mtime;
+    key->xml_size = xml_stat.st_size;
+    key->xml_hash = xml_hash;
+    key->ctl_fingerprint = mixer_ctl_fingerprint(ar);
+    key->num_ctls = ar->num_mixer_ctls;
+    strncpy(key->codec, ar->codec, sizeof(key->codec) - 1);
+    return true;
+}
+
+/*
+ * Parses the xml into a copy of the route which shares the ctls of ar and
+ * owns nothing but the new path tables. Only reads parts of ar that don't
+ * change after init, so it can run alongside the user of the route.
+ */
+static struct audio_route *route_reload_parse(struct audio_route *ar)
+{
+    struct audio_route *copy;
+    struct route_cache_key cache_key;
+
+    copy = calloc(1, sizeof(struct audio_route));
+    if (!copy)
+        return NULL;
+
+    copy->mixer = ar->mixer;
+    copy->ctl_index = ar->ctl_index;
+    copy->num_mixer_ctls = ar->num_mixer_ctls;
+    copy->mixer_state = ar->mixer_state;
+    strcpy(copy->xml_path, ar->xml_path);
+    strcpy(copy->codec, ar->codec);
+
+    if (route_parse_xml(copy, copy->xml_path) < 0) {
+        path_free(copy);
+        free(copy);
+        return NULL;
+    }
+
+    if (route_cache_key_get(copy, &cache_key))
+        route_cache_save(copy, ar->cache_path, &cache_key);
+
+    return copy;
+}
+
+static void *reload_thread_loop(void *context)
+{
+    struct audio_route *ar = (struct audio_route *)context;
+    struct audio_route *copy;
+    struct inotify_event *event;
+    struct pollfd fds[2];
+    const char *xml_name;
+    char buf[RELOAD_EVENT_BUF_SIZE]
+            __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    bool changed;
+    ssize_t len;
+    char *p;
+
+    xml_name = strrchr(ar->xml_path, '/') + 1;
+
+    fds[0].fd = ar->reload_fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = ar->reload_pipe[0];
+    fds[1].events = POLLIN;
+
+    for (;;) {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            ALOGE("Unable to poll the mixer xml watch");
+            break;
+        }
+        if (fds[1].revents)
+            break;
+
+        len = read(ar->reload_fd, buf, sizeof(buf));
+        if (len <= 0)
+            continue;
+
+        /* an editor may write the file several times, one parse will do */
+        changed = false;
+        for (p = buf; p < buf + len; p += sizeof(*event) + event->len) {
+            event = (struct inotify_event *)p;
+            if (event->len && strcmp(event->name, xml_name) == 0)
+                changed = true;
+        }
+        if (!changed)
+            continue;
+
+        ALOGV("%s changed, reloading", ar->xml_path);
+        copy = route_reload_parse(ar);
+        if (!copy) {
+            ALOGE("Unable to reload %s, keeping the current paths",
+                  ar->xml_path);
+            continue;
+        }
+
+        /* a reload that was never picked up is simply replaced */
+        pthread_mutex_lock(&ar->reload_lock);
+        if (ar->reload_pending) {
+            path_free(ar->reload_pending);
+            free(ar->reload_pending);
+        }
+        ar->reload_pending = copy;
+        pthread_mutex_unlock(&ar->reload_lock);
+
+        if (ar->reload_changed)
+            ar->reload_changed(ar->reload_context);
+    }
+
+    return NULL;
+}
+
+int audio_route_watch_xml(struct audio_route *ar,
+                          void (*changed)(void *context), void *context)
+{
+    char xml_dir[PATH_MAX];
+    char *slash;
+
+    if (!ar || ar->reload_watching)
+        return -1;
+
+    strcpy(xml_dir, ar->xml_path);
+    slash = strrchr(xml_dir, '/');
+    if (!slash)
+        return -1;
+    *slash = '\0';
+
+    /* the directory is watched, as the file may be replaced by a rename */
+    ar->reload_fd = inotify_init();
+    if (ar->reload_fd < 0) {
+        ALOGE("Unable to init inotify for %s", ar->xml_path);
+        goto err_inotify;
+    }
+    if (inotify_add_watch(ar->reload_fd, xml_dir,
+                          IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+        ALOGE("Unable to watch %s", xml_dir);
+        goto err_watch;
+    }
+    if (pipe(ar->reload_pipe) < 0)
+        goto err_watch;
+
+    ar->reload_changed = changed;
+    ar->reload_context = context;
+    ar->reload_watching = true;
+    if (pthread_create(&ar->reload_thread, NULL, reload_thread_loop, ar)) {
+        ALOGE("Unable to create the mixer xml watch thread");
+        ar->reload_watching = false;
+        goto err_thread;
+    }
+
+    return 0;
+
+err_thread:
+    close(ar->reload_pipe[0]);
+    close(ar->reload_pipe[1]);
+err_watch:
+    close(ar->reload_fd);
+err_inotify:
+    return -1;
+}
+
+static void route_reload_stop(struct audio_route *ar)
+{
+    if (!ar->reload_watching)
+        return;
+
+    write(ar->reload_pipe[1], "", 1);
+    pthread_join(ar->reload_thread, NULL);
+    close(ar->reload_pipe[0]);
+    close(ar->reload_pipe[1]);
+    close(ar->reload_fd);
+    ar->reload_watching = false;
+
+    if (ar->reload_pending) {
+        path_free(ar->reload_pending);
+        free(ar->reload_pending);
+        ar->reload_pending = NULL;
+    }
+}
+
+struct audio_route *audio_route_init(unsigned int card_slot)
+{
     int fd, cnt;
-    struct mixer_path *path;
     struct audio_route *ar;
-    char   vendor_xml_path[PATH_MAX];
+    struct route_cache_key cache_key;
+    bool use_cache;
     char   codec_vendor_name[PATH_MAX];
     char   vendor_name[255];
     char  *tmpchar;
@@ -538,6 +2172,8 @@ struct audio_route *audio_route_init(unsigned int card_slot)
     ar = calloc(1, sizeof(struct audio_route));
     if (!ar)
         goto err_calloc;
+    ar->current_route = ROUTE_NONE;
+    pthread_mutex_init(&ar->reload_lock, NULL);
 
     ar->mixer = mixer_open(card_slot);
     if (!ar->mixer) {
@@ -549,8 +2185,14 @@ struct audio_route *audio_route_init(unsigned int card_slot)
     ar->mixer_path = NULL;
     ar->mixer_path_size = 0;
     ar->num_mixer_paths = 0;
+    ar->path_hash = NULL;
 
-    /* allocate space for and read current mixer settings */
+    /* index the controls once for the xml and the path cache */
+    ar->ctl_index = ctl_index_create(ar->mixer);
+    if (!ar->ctl_index)
+        goto err_ctl_index;
+
+    /* allocate space for the mixer settings */
     if (alloc_mixer_state(ar) < 0)
         goto err_mixer_state;
 
@@ -580,62 +2222,37 @@ struct audio_route *audio_route_init(unsigned int card_slot)
         tmpchar++;
     }
 
-    sprintf(vendor_xml_path, MIXER_XML_PATH, vendor_name);
-    ALOGV("Opening up %s.", vendor_xml_path);
-    file = fopen(vendor_xml_path, "r");
-    if (!file) {
-        ALOGE("Failed to open %s", vendor_xml_path);
-        goto err_fopen;
-    }
-
-    parser = XML_ParserCreate(NULL);
-    if (!parser) {
-        ALOGE("Failed to create XML parser");
-        goto err_parser_create;
-    }
+    snprintf(ar->xml_path, sizeof(ar->xml_path), MIXER_XML_PATH, vendor_name);
+    snprintf(ar->cache_path, sizeof(ar->cache_path), MIXER_CACHE_PATH,
+             vendor_name);
+    strncpy(ar->codec, vendor_name, sizeof(ar->codec) - 1);
 
-    memset(&state, 0, sizeof(state));
-    state.ar = ar;
-    XML_SetUserData(parser, &state);
-    XML_SetElementHandler(parser, start_tag, end_tag);
-
-    for (;;) {
-        buf = XML_GetBuffer(parser, BUF_SIZE);
-        if (buf == NULL)
-            goto err_parse;
-
-        bytes_read = fread(buf, 1, BUF_SIZE, file);
-        if (ferror(file))
+    /* a warm start loads the compiled paths and skips the xml entirely */
+    use_cache = route_cache_key_get(ar, &cache_key);
+    if (!use_cache || route_cache_load(ar, ar->cache_path, &cache_key) < 0) {
+        ALOGV("Opening up %s.", ar->xml_path);
+        if (route_parse_xml(ar, ar->xml_path) < 0)
             goto err_parse;
-
-        if (XML_ParseBuffer(parser, bytes_read,
-                            bytes_read == 0) == XML_STATUS_ERROR) {
-            ALOGE("Error in mixer xml (%s)", MIXER_XML_PATH);
-            goto err_parse;
-        }
-
-        if (bytes_read == 0)
-            break;
+        if (use_cache)
+            route_cache_save(ar, ar->cache_path, &cache_key);
     }
 
-    /* apply the initial mixer values, and save them so we can reset the
-       mixer to the original values */
+    /* apply the initial mixer values, which are also the values the mixer
+       is reset to */
+    init_path_apply(ar);
     update_mixer_state(ar);
-    save_mixer_state(ar);
 
-    XML_ParserFree(parser);
-    fclose(file);
     return ar;
 
 err_parse:
-    XML_ParserFree(parser);
-err_parser_create:
-    fclose(file);
-err_fopen:
+    path_free(ar);
     free_mixer_state(ar);
 err_mixer_state:
+    ctl_index_free(ar->ctl_index);
+err_ctl_index:
     mixer_close(ar->mixer);
 err_mixer_open:
+    pthread_mutex_destroy(&ar->reload_lock);
     free(ar);
     ar = NULL;
 err_calloc:
@@ -644,9 +2261,13 @@ err_calloc:
 
 void audio_route_free(struct audio_route *ar)
 {
+    route_reload_stop(ar);
+    route_memo_flush(ar);
     free_mixer_state(ar);
+    ctl_index_free(ar->ctl_index);
     mixer_close(ar->mixer);
     path_free(ar);
+    pthread_mutex_destroy(&ar->reload_lock);
     free(ar);
     ar = NULL;
 }
@@ -17,19 +17,45 @@
 #ifndef AUDIO_ROUTE_H
 #define AUDIO_ROUTE_H
 
+/* Mixer commit counters, see audio_route_get_stats() */
+struct audio_route_stats {
+    unsigned int ctls_scanned;          /* controls visited by the last commit */
+    unsigned int ctls_written;          /* controls written by the last commit */
+    unsigned long long total_scanned;
+    unsigned long long total_written;
+    unsigned long long commits;
+    unsigned long long route_hits;      /* commits replayed from the route memo */
+};
+
 /* Initialises and frees the audio routes */
 struct audio_route *audio_route_init(unsigned int card_slot);
 void audio_route_free(struct audio_route *ar);
 
+/* Watches the mixer xml and reloads its paths when it changes. They are
+ * swapped in the next time paths are applied, changed is called from the
+ * watch thread once they are ready. Stopped by audio_route_free() */
+int audio_route_watch_xml(struct audio_route *ar,
+                          void (*changed)(void *context), void *context);
+
 /* Applies an audio route path by name */
 void audio_route_apply_path(struct audio_route *ar, const char *name);
 
+/* Resets the mixer and applies the named paths in order, then updates the
+ * mixer. Changes between sets of paths applied before are replayed as a
+ * single precomputed batch of writes */
+int audio_route_apply_route(struct audio_route *ar,
+                            const char * const *names, unsigned int num_names);
+
 /* Resets the mixer back to its initial state */
 void reset_mixer_state(struct audio_route *ar);
 
 /* Updates the mixer with any changed values */
 void update_mixer_state(struct audio_route *ar);
 
+/* Returns the commit counters of the audio route */
+void audio_route_get_stats(struct audio_route *ar,
+                           struct audio_route_stats *stats);
+
 /* Set specific control values on a specified card */
 int audio_route_control_set_number(unsigned int card_slot, char *control_name,
                                    char *control_value);
@@ -37,4 +63,19 @@ int audio_route_control_set_number(unsigned int card_slot, char *control_name,
 /* Set specific control values on a specified card */
 int audio_route_control_set_enum(unsigned int card_slot, char *control_name,
                                  char *control_value);
+
+/* A control to set with audio_route_control_set_batch() */
+struct audio_route_control {
+    const char *name;
+    const char *value;  /* a number, or a string for enum controls */
+};
+
+/* Sets several controls on a specified card, returns the number of failures
+ * or -1 if the card can't be opened */
+int audio_route_control_set_batch(unsigned int card_slot,
+                                  const struct audio_route_control *controls,
+                                  unsigned int num_controls);
+
+/* Closes the control mixer cached for a card, e.g. once it is removed */
+void audio_route_control_release(unsigned int card_slot);
 #endif
@@ -0,0 +1,346 @@
+/*
+ * Copyright (C) 2012 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "card_registry"
+/*#define LOG_NDEBUG 0*/
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include <sys/ioctl.h>
+
+#include <cutils/log.h>
+
+#include <sound/asound.h>
+
+#include "card_registry.h"
+
+#define SND_DEV_DIR "/dev/snd"
+#define CARD_CTRL_PATH SND_DEV_DIR "/controlC%u"
+#define PCM_DEV_PATH SND_DEV_DIR "/pcmC%uD%u%c"
+#define CODEC_CHIP_NAME_PATH "/sys/class/sound/hwC%uD0/chip_name"
+#define MAX_PCM_DEVICES 32
+#define EVENT_BUF_SIZE 4096
+
+struct card_entry {
+    bool present;
+    struct card_registry_info info;
+    uint32_t playback;  /* accessible playback pcm devices, one bit each */
+    uint32_t capture;   /* accessible capture pcm devices, one bit each */
+};
+
+/*
+ * The cards are scanned once, then the watch thread rescans a card or pcm
+ * device whenever its node in /dev/snd is created, deleted or changes
+ * permissions. Without a watch every query rescans, as before.
+ */
+struct card_registry {
+    pthread_mutex_t lock;
+    struct card_entry card[CARD_REGISTRY_MAX_CARDS];
+
+    bool watching;
+    pthread_t thread;
+    int inotify_fd;
+    int pipe[2];
+};
+
+/* reads the card info and codec name of a card, without the lock held */
+static bool card_read_info(unsigned int card_slot,
+                           struct card_registry_info *info)
+{
+    struct snd_ctl_card_info card_info;
+    char path[PATH_MAX];
+    int fd, cnt;
+
+    snprintf(path, sizeof(path), CARD_CTRL_PATH, card_slot);
+    fd = open(path, O_RDONLY);
+    if (fd == -1)
+        return false;
+
+    memset(&card_info, 0, sizeof(card_info));
+    if (ioctl(fd, SNDRV_CTL_IOCTL_CARD_INFO, &card_info) < 0) {
+        ALOGE("card %u: SNDRV_CTL_IOCTL_CARD_INFO failed", card_slot);
+        close(fd);
+        return false;
+    }
+    close(fd);
+
+    memset(info, 0, sizeof(*info));
+    strncpy(info->driver, (char *)card_info.driver, sizeof(info->driver) - 1);
+    strncpy(info->id, (char *)card_info.id, sizeof(info->id) - 1);
+
+    snprintf(path, sizeof(path), CODEC_CHIP_NAME_PATH, card_slot);
+    fd = open(path, O_RDONLY);
+    if (fd != -1) {
+        cnt = read(fd, info->codec, sizeof(info->codec) - 1);
+        if (cnt > 0)
+            info->codec[cnt - 1] = '\0';
+        else
+            info->codec[0] = '\0';
+        close(fd);
+    }
+
+    return true;
+}
+
+static bool pcm_accessible(unsigned int card_slot, unsigned int device,
+                           bool capture)
+{
+    char path[PATH_MAX];
+
+    snprintf(path, sizeof(path), PCM_DEV_PATH, card_slot, device,
+             capture ? 'c' : 'p');
+    return access(path, R_OK | W_OK) == 0;
+}
+
+static void card_update(struct card_registry *reg, unsigned int card_slot)
+{
+    struct card_registry_info info;
+    bool present;
+
+    present = card_read_info(card_slot, &info);
+
+    pthread_mutex_lock(&reg->lock);
+    reg->card[card_slot].present = present;
+    if (present)
+        reg->card[card_slot].info = info;
+    pthread_mutex_unlock(&reg->lock);
+
+    ALOGV("card %u %s", card_slot, present ? info.driver : "removed");
+}
+
+static void pcm_update(struct card_registry *reg, unsigned int card_slot,
+                       unsigned int device, bool capture)
+{
+    uint32_t *pcms;
+    bool accessible;
+
+    accessible = pcm_accessible(card_slot, device, capture);
+
+    pthread_mutex_lock(&reg->lock);
+    pcms = capture ? &reg->card[card_slot].capture :
+                     &reg->card[card_slot].playback;
+    if (accessible)
+        *pcms |= 1u << device;
+    else
+        *pcms &= ~(1u << device);
+    pthread_mutex_unlock(&reg->lock);
+}
+
+/* updates the card or pcm device a /dev/snd node belongs to */
+static void node_update(struct card_registry *reg, const char *name)
+{
+    unsigned int card_slot, device;
+    char dir;
+    int len = 0;
+
+    if (sscanf(name, "controlC%u%n", &card_slot, &len) == 1 &&
+            name[len] == '\0' && card_slot < CARD_REGISTRY_MAX_CARDS) {
+        card_update(reg, card_slot);
+    } else if (sscanf(name, "pcmC%uD%u%c%n", &card_slot, &device, &dir,
+                      &len) == 3 && name[len] == '\0' &&
+            card_slot < CARD_REGISTRY_MAX_CARDS && device < MAX_PCM_DEVICES &&
+            (dir == 'p' || dir == 'c')) {
+        pcm_update(reg, card_slot, device, dir == 'c');
+    }
+}
+
+/* rescans all the nodes of /dev/snd */
+static void registry_scan(struct card_registry *reg)
+{
+    struct dirent *entry;
+    DIR *dir;
+
+    pthread_mutex_lock(&reg->lock);
+    memset(reg->card, 0, sizeof(reg->card));
+    pthread_mutex_unlock(&reg->lock);
+
+    dir = opendir(SND_DEV_DIR);
+    if (!dir) {
+        ALOGE("Unable to open %s", SND_DEV_DIR);
+        return;
+    }
+    while ((entry = readdir(dir)) != NULL)
+        node_update(reg, entry->d_name);
+    closedir(dir);
+}
+
+static void *registry_thread_loop(void *context)
+{
+    struct card_registry *reg = (struct card_registry *)context;
+    struct inotify_event *event;
+    struct pollfd fds[2];
+    char buf[EVENT_BUF_SIZE]
+            __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    ssize_t len;
+    char *p;
+
+    fds[0].fd = reg->inotify_fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = reg->pipe[0];
+    fds[1].events = POLLIN;
+
+    for (;;) {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            ALOGE("Unable to poll the %s watch", SND_DEV_DIR);
+            break;
+        }
+        if (fds[1].revents)
+            break;
+
+        len = read(reg->inotify_fd, buf, sizeof(buf));
+        if (len <= 0)
+            continue;
+
+        for (p = buf; p < buf + len; p += sizeof(*event) + event->len) {
+            event = (struct inotify_event *)p;
+            if (event->mask & IN_Q_OVERFLOW)
+                registry_scan(reg);
+            else if (event->len)
+                node_update(reg, event->name);
+        }
+    }
+
+    return NULL;
+}
+
+struct card_registry *card_registry_open(void)
+{
+    struct card_registry *reg;
+
+    reg = calloc(1, sizeof(struct card_registry));
+    if (!reg)
+        return NULL;
+    pthread_mutex_init(&reg->lock, NULL);
+
+    /* ueventd creates the nodes and then sets their permissions, so both
+       are watched */
+    reg->inotify_fd = inotify_init();
+    if (reg->inotify_fd < 0)
+        goto err_inotify;
+    if (inotify_add_watch(reg->inotify_fd, SND_DEV_DIR,
+                          IN_CREATE | IN_DELETE | IN_ATTRIB | IN_MOVED_TO |
+                          IN_MOVED_FROM) < 0)
+        goto err_watch;
+    if (pipe(reg->pipe) < 0)
+        goto err_watch;
+
+    /* scan after the watch is added, so that no change is missed */
+    registry_scan(reg);
+
+    if (pthread_create(&reg->thread, NULL, registry_thread_loop, reg))
+        goto err_thread;
+    reg->watching = true;
+
+    return reg;
+
+err_thread:
+    close(reg->pipe[0]);
+    close(reg->pipe[1]);
+err_watch:
+    close(reg->inotify_fd);
+err_inotify:
+    ALOGE("Unable to watch %s, cards will be rescanned on each query",
+          SND_DEV_DIR);
+    return reg;
+}
+
+void card_registry_close(struct card_registry *reg)
+{
+    if (!reg)
+        return;
+
+    if (reg->watching) {
+        write(reg->pipe[1], "", 1);
+        pthread_join(reg->thread, NULL);
+        close(reg->pipe[0]);
+        close(reg->pipe[1]);
+        close(reg->inotify_fd);
+    }
+
+    pthread_mutex_destroy(&reg->lock);
+    free(reg);
+}
+
+bool card_registry_get(struct card_registry *reg, unsigned int card_slot,
+                       struct card_registry_info *info)
+{
+    bool present;
+
+    if (card_slot >= CARD_REGISTRY_MAX_CARDS)
+        return false;
+    if (!reg->watching)
+        registry_scan(reg);
+
+    pthread_mutex_lock(&reg->lock);
+    present = reg->card[card_slot].present;
+    if (present)
+        *info = reg->card[card_slot].info;
+    pthread_mutex_unlock(&reg->lock);
+
+    return present;
+}
+
+int card_registry_find_driver(struct card_registry *reg, const char *driver,
+                              uint32_t skip_slots)
+{
+    unsigned int card_slot;
+    int found = -1;
+
+    if (!reg->watching)
+        registry_scan(reg);
+
+    pthread_mutex_lock(&reg->lock);
+    for (card_slot = 0; card_slot < CARD_REGISTRY_MAX_CARDS; card_slot++) {
+        if ((skip_slots & (1u << card_slot)) || !reg->card[card_slot].present)
+            continue;
+        if (strncmp(reg->card[card_slot].info.driver, driver,
+                    strlen(driver)) == 0) {
+            found = card_slot;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&reg->lock);
+
+    return found;
+}
+
+bool card_registry_has_pcm(struct card_registry *reg, unsigned int card_slot,
+                           unsigned int device, bool capture)
+{
+    uint32_t pcms;
+
+    if (card_slot >= CARD_REGISTRY_MAX_CARDS || device >= MAX_PCM_DEVICES)
+        return false;
+    if (!reg->watching)
+        return pcm_accessible(card_slot, device, capture);
+
+    pthread_mutex_lock(&reg->lock);
+    pcms = capture ? reg->card[card_slot].capture :
+                     reg->card[card_slot].playback;
+    pthread_mutex_unlock(&reg->lock);
+
+    return (pcms & (1u << device)) != 0;
+}
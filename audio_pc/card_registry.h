@@ -0,0 +1,49 @@
+/*
+ * Copyright (C) 2012 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef CARD_REGISTRY_H
+#define CARD_REGISTRY_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* as many cards as ALSA supports (SNDRV_CARDS) */
+#define CARD_REGISTRY_MAX_CARDS 32
+
+/* What is known about a sound card */
+struct card_registry_info {
+    char driver[16];
+    char id[16];
+    char codec[64];     /* chip_name of the first codec, empty if unknown */
+};
+
+/* Scans the sound cards and keeps watching /dev/snd for changes */
+struct card_registry *card_registry_open(void);
+void card_registry_close(struct card_registry *reg);
+
+/* Gets the info of the card in a slot, returns false if there is none */
+bool card_registry_get(struct card_registry *reg, unsigned int card_slot,
+                       struct card_registry_info *info);
+
+/* Returns the first card whose driver starts with driver, skipping the
+ * slots set in skip_slots, or -1 if there is none */
+int card_registry_find_driver(struct card_registry *reg, const char *driver,
+                              uint32_t skip_slots);
+
+/* Returns true if the pcm device of a card exists and can be opened */
+bool card_registry_has_pcm(struct card_registry *reg, unsigned int card_slot,
+                           unsigned int device, bool capture);
+#endif
@@ -0,0 +1,172 @@
+/*
+ * Copyright (C) 2012 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "downmix"
+/*#define LOG_NDEBUG 0*/
+
+#include <pthread.h>
+#include <stdbool.h>
+
+#include <cutils/log.h>
+
+#include "downmix.h"
+
+#if defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__))
+#define DOWNMIX_X86 1
+#include <cpuid.h>
+#include <emmintrin.h>
+#endif
+
+/*
+ * All kernels work front to back and load a block of frames before storing
+ * its mono samples, which is what makes dst == src safe: a block never
+ * stores past the stereo samples it has already loaded.
+ */
+
+static int16_t clamp16(int32_t sample)
+{
+    if (sample > INT16_MAX)
+        return INT16_MAX;
+    if (sample < INT16_MIN)
+        return INT16_MIN;
+    return sample;
+}
+
+static void downmix_scalar(int16_t *dst, const int16_t *src, size_t frames,
+                           enum downmix_mode mode)
+{
+    size_t i;
+
+    switch (mode) {
+    case DOWNMIX_DISCARD_RIGHT:
+        for (i = 0; i < frames; i++)
+            dst[i] = src[i * 2];
+        break;
+    case DOWNMIX_DISCARD_LEFT:
+        for (i = 0; i < frames; i++)
+            dst[i] = src[i * 2 + 1];
+        break;
+    case DOWNMIX_AVERAGE:
+        /* an arithmetic shift, like the vector kernels */
+        for (i = 0; i < frames; i++)
+            dst[i] = ((int32_t)src[i * 2] + src[i * 2 + 1]) >> 1;
+        break;
+    case DOWNMIX_SUM:
+        for (i = 0; i < frames; i++)
+            dst[i] = clamp16((int32_t)src[i * 2] + src[i * 2 + 1]);
+        break;
+    }
+}
+
+#ifdef DOWNMIX_X86
+/* 4 stereo frames to 4 mono samples as 32 bit lanes */
+static inline __m128i downmix_sse2_lanes(__m128i frames, enum downmix_mode mode)
+{
+    switch (mode) {
+    case DOWNMIX_DISCARD_RIGHT:
+        return _mm_srai_epi32(_mm_slli_epi32(frames, 16), 16);
+    case DOWNMIX_DISCARD_LEFT:
+        return _mm_srai_epi32(frames, 16);
+    case DOWNMIX_AVERAGE:
+        return _mm_srai_epi32(_mm_madd_epi16(frames, _mm_set1_epi16(1)), 1);
+    case DOWNMIX_SUM:
+    default:
+        return _mm_madd_epi16(frames, _mm_set1_epi16(1));
+    }
+}
+
+/* 8 frames at a time, the lanes are packed with saturation, which only
+   matters for DOWNMIX_SUM */
+static size_t downmix_sse2(int16_t *dst, const int16_t *src, size_t frames,
+                           enum downmix_mode mode)
+{
+    __m128i a, b;
+    size_t i;
+
+    for (i = 0; i + 8 <= frames; i += 8) {
+        a = _mm_loadu_si128((const __m128i *)(src + i * 2));
+        b = _mm_loadu_si128((const __m128i *)(src + i * 2 + 8));
+        a = downmix_sse2_lanes(a, mode);
+        b = downmix_sse2_lanes(b, mode);
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_packs_epi32(a, b));
+    }
+
+    return i;
+}
+
+#ifdef DOWNMIX_AVX2
+/* in downmix_avx2.c, the only file built with -mavx2 */
+size_t downmix_avx2(int16_t *dst, const int16_t *src, size_t frames,
+                    enum downmix_mode mode);
+
+/* AVX2 needs both the instructions and the OS saving the ymm registers */
+static bool cpu_has_avx2(void)
+{
+    unsigned int eax, ebx, ecx, edx;
+    unsigned int xcr0_lo, xcr0_hi;
+
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+        return false;
+    if (!(ecx & bit_OSXSAVE) || !(ecx & bit_AVX))
+        return false;
+
+    /* xgetbv, spelled out so that no -mxsave is needed */
+    __asm__ volatile (".byte 0x0f, 0x01, 0xd0"
+                      : "=a" (xcr0_lo), "=d" (xcr0_hi) : "c" (0));
+    if ((xcr0_lo & 0x6) != 0x6)
+        return false;
+
+    if (__get_cpuid_max(0, NULL) < 7)
+        return false;
+    __cpuid_count(7, 0, eax, ebx, ecx, edx);
+    return (ebx & bit_AVX2) != 0;
+}
+#endif /* DOWNMIX_AVX2 */
+#endif
+
+/* vector kernel for the bulk of the frames, returns the frames it did */
+typedef size_t (*downmix_kernel_t)(int16_t *dst, const int16_t *src,
+                                   size_t frames, enum downmix_mode mode);
+
+static pthread_once_t downmix_once = PTHREAD_ONCE_INIT;
+static downmix_kernel_t downmix_kernel;
+
+static void downmix_select_kernel(void)
+{
+#ifdef DOWNMIX_X86
+#ifdef DOWNMIX_AVX2
+    if (cpu_has_avx2()) {
+        downmix_kernel = downmix_avx2;
+        ALOGV("using AVX2 kernels");
+        return;
+    }
+#endif
+    downmix_kernel = downmix_sse2;
+    ALOGV("using SSE2 kernels");
+#endif
+}
+
+void downmix_stereo_to_mono(int16_t *dst, const int16_t *src, size_t frames,
+                            enum downmix_mode mode)
+{
+    size_t done = 0;
+
+    pthread_once(&downmix_once, downmix_select_kernel);
+
+    if (downmix_kernel)
+        done = downmix_kernel(dst, src, frames, mode);
+    downmix_scalar(dst + done, src + done * 2, frames - done, mode);
+}
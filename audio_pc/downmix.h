@@ -0,0 +1,35 @@
+/*
+ * Copyright (C) 2012 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef DOWNMIX_H
+#define DOWNMIX_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* How the two channels of a stereo frame make a mono sample */
+enum downmix_mode {
+    DOWNMIX_DISCARD_RIGHT,  /* keep the left channel */
+    DOWNMIX_DISCARD_LEFT,   /* keep the right channel */
+    DOWNMIX_AVERAGE,        /* (left + right) / 2 */
+    DOWNMIX_SUM,            /* left + right, saturated */
+};
+
+/* Downmixes interleaved S16 stereo frames to mono. dst may be src, for an
+ * in place downmix, but must not otherwise overlap it */
+void downmix_stereo_to_mono(int16_t *dst, const int16_t *src, size_t frames,
+                            enum downmix_mode mode);
+#endif
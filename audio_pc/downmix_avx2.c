@@ -0,0 +1,65 @@
+/*
+ * Copyright (C) 2012 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <immintrin.h>
+
+#include "downmix.h"
+
+/*
+ * The AVX2 kernel of downmix.c. It is in a file of its own, built with
+ * -mavx2, as older compilers only provide the AVX2 intrinsics to files
+ * built that way. downmix.c only calls it once the CPU is known to have
+ * AVX2.
+ */
+
+size_t downmix_avx2(int16_t *dst, const int16_t *src, size_t frames,
+                    enum downmix_mode mode);
+
+static inline __m256i downmix_avx2_lanes(__m256i frames, enum downmix_mode mode)
+{
+    switch (mode) {
+    case DOWNMIX_DISCARD_RIGHT:
+        return _mm256_srai_epi32(_mm256_slli_epi32(frames, 16), 16);
+    case DOWNMIX_DISCARD_LEFT:
+        return _mm256_srai_epi32(frames, 16);
+    case DOWNMIX_AVERAGE:
+        return _mm256_srai_epi32(
+                _mm256_madd_epi16(frames, _mm256_set1_epi16(1)), 1);
+    case DOWNMIX_SUM:
+    default:
+        return _mm256_madd_epi16(frames, _mm256_set1_epi16(1));
+    }
+}
+
+/* 16 frames at a time, packing works per 128 bit half so the quarters are
+   put back in order afterwards */
+size_t downmix_avx2(int16_t *dst, const int16_t *src, size_t frames,
+                    enum downmix_mode mode)
+{
+    __m256i a, b;
+    size_t i;
+
+    for (i = 0; i + 16 <= frames; i += 16) {
+        a = _mm256_loadu_si256((const __m256i *)(src + i * 2));
+        b = _mm256_loadu_si256((const __m256i *)(src + i * 2 + 16));
+        a = downmix_avx2_lanes(a, mode);
+        b = downmix_avx2_lanes(b, mode);
+        _mm256_storeu_si256((__m256i *)(dst + i),
+                _mm256_permute4x64_epi64(_mm256_packs_epi32(a, b), 0xd8));
+    }
+
+    return i;
+}
@@ -0,0 +1,305 @@
+/*
+ * Copyright (C) 2012 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "format_convert"
+/*#define LOG_NDEBUG 0*/
+
+#include <string.h>
+
+#include "format_convert.h"
+
+#if defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__))
+#define FORMAT_CONVERT_SSE2 1
+#include <emmintrin.h>
+#endif
+
+/*
+ * Conversions between two formats go through blocks of Q0.31 samples, so
+ * that each format only needs a conversion to and from Q0.31.
+ */
+#define FORMAT_BLOCK 256
+
+#define Q31_SCALE 2147483648.0f
+#define Q31_MAX_FLOAT 2147483520.0f     /* the largest float below 2^31 */
+#define S24_MAX ((1 << 23) - 1)
+#define S24_MIN (-(1 << 23))
+
+size_t format_sample_size(enum sample_format format)
+{
+    switch (format) {
+    case SAMPLE_FORMAT_S16:
+        return sizeof(int16_t);
+    case SAMPLE_FORMAT_FLOAT:
+        return sizeof(float);
+    case SAMPLE_FORMAT_S24:
+    case SAMPLE_FORMAT_S32:
+    default:
+        return sizeof(int32_t);
+    }
+}
+
+/* xorshift32, the SSE2 code runs one generator per lane */
+static inline uint32_t dither_next(uint32_t *state)
+{
+    uint32_t x = *state;
+
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *state = x;
+    return x;
+}
+
+void format_dither_init(struct format_dither *dither, uint32_t seed)
+{
+    unsigned int i;
+
+    for (i = 0; i < 4; i++) {
+        seed = seed * 1664525 + 1013904223;
+        /* xorshift would stay at 0 */
+        dither->state[i] = seed ? seed : 1;
+    }
+}
+
+static void to_q31(int32_t *q, const void *src, enum sample_format format,
+                   size_t count)
+{
+    size_t i = 0;
+
+    switch (format) {
+    case SAMPLE_FORMAT_S16: {
+        const int16_t *s = src;
+#ifdef FORMAT_CONVERT_SSE2
+        __m128i zero = _mm_setzero_si128();
+        __m128i v;
+
+        /* a sample in the high half of a lane is the sample << 16 */
+        for (; i + 8 <= count; i += 8) {
+            v = _mm_loadu_si128((const __m128i *)(s + i));
+            _mm_storeu_si128((__m128i *)(q + i), _mm_unpacklo_epi16(zero, v));
+            _mm_storeu_si128((__m128i *)(q + i + 4),
+                             _mm_unpackhi_epi16(zero, v));
+        }
+#endif
+        for (; i < count; i++)
+            q[i] = s[i] * 65536;
+        break;
+    }
+    case SAMPLE_FORMAT_S24: {
+        const int32_t *s = src;
+#ifdef FORMAT_CONVERT_SSE2
+        __m128i max = _mm_set1_epi32(S24_MAX);
+        __m128i min = _mm_set1_epi32(S24_MIN);
+        __m128i v, mask;
+
+        /* 8.24 samples may be above full scale */
+        for (; i + 4 <= count; i += 4) {
+            v = _mm_loadu_si128((const __m128i *)(s + i));
+            mask = _mm_cmpgt_epi32(v, max);
+            v = _mm_or_si128(_mm_and_si128(mask, max),
+                             _mm_andnot_si128(mask, v));
+            mask = _mm_cmplt_epi32(v, min);
+            v = _mm_or_si128(_mm_and_si128(mask, min),
+                             _mm_andnot_si128(mask, v));
+            _mm_storeu_si128((__m128i *)(q + i), _mm_slli_epi32(v, 8));
+        }
+#endif
+        for (; i < count; i++) {
+            if (s[i] > S24_MAX)
+                q[i] = S24_MAX * 256;
+            else if (s[i] < S24_MIN)
+                q[i] = S24_MIN * 256;
+            else
+                q[i] = s[i] * 256;
+        }
+        break;
+    }
+    case SAMPLE_FORMAT_FLOAT: {
+        const float *s = src;
+        float x;
+#ifdef FORMAT_CONVERT_SSE2
+        __m128 scale = _mm_set1_ps(Q31_SCALE);
+        __m128 max = _mm_set1_ps(Q31_MAX_FLOAT);
+        __m128 min = _mm_set1_ps(-Q31_SCALE);
+        __m128 v;
+
+        /* min first, as it turns a NaN into max */
+        for (; i + 4 <= count; i += 4) {
+            v = _mm_mul_ps(_mm_loadu_ps(s + i), scale);
+            v = _mm_max_ps(_mm_min_ps(v, max), min);
+            _mm_storeu_si128((__m128i *)(q + i), _mm_cvtps_epi32(v));
+        }
+#endif
+        for (; i < count; i++) {
+            x = s[i] * Q31_SCALE;
+            if (!(x < Q31_MAX_FLOAT))
+                q[i] = INT32_MAX;
+            else if (x < -Q31_SCALE)
+                q[i] = INT32_MIN;
+            else
+                q[i] = x;
+        }
+        break;
+    }
+    case SAMPLE_FORMAT_S32:
+    default:
+        memcpy(q, src, count * sizeof(int32_t));
+        break;
+    }
+}
+
+/*
+ * Q0.31 to S16. The dither is the sum of the two 16 bit halves of a
+ * random number, triangular over +-1 LSB, and half an LSB makes the
+ * truncation round. The samples are halved first not to overflow.
+ */
+static void q31_to_s16(int16_t *d, const int32_t *q, size_t count,
+                       struct format_dither *dither)
+{
+    size_t i = 0;
+    int32_t v;
+
+    if (dither) {
+#ifdef FORMAT_CONVERT_SSE2
+        __m128i state = _mm_loadu_si128((const __m128i *)dither->state);
+        __m128i low = _mm_set1_epi32(0xffff);
+        __m128i offset = _mm_set1_epi32(32767);
+        __m128i lo, hi, r;
+
+#define DITHER_LANES(dst, src) do { \
+            state = _mm_xor_si128(state, _mm_slli_epi32(state, 13)); \
+            state = _mm_xor_si128(state, _mm_srli_epi32(state, 17)); \
+            state = _mm_xor_si128(state, _mm_slli_epi32(state, 5)); \
+            r = _mm_sub_epi32(_mm_add_epi32(_mm_srli_epi32(state, 16), \
+                                            _mm_and_si128(state, low)), \
+                              offset); \
+            dst = _mm_srai_epi32(_mm_add_epi32( \
+                    _mm_srai_epi32(_mm_loadu_si128((const __m128i *)(src)), \
+                                   1), \
+                    _mm_srai_epi32(r, 1)), 15); \
+        } while (0)
+
+        for (; i + 8 <= count; i += 8) {
+            DITHER_LANES(lo, q + i);
+            DITHER_LANES(hi, q + i + 4);
+            _mm_storeu_si128((__m128i *)(d + i), _mm_packs_epi32(lo, hi));
+        }
+#undef DITHER_LANES
+        _mm_storeu_si128((__m128i *)dither->state, state);
+#endif
+        for (; i < count; i++) {
+            uint32_t r = dither_next(&dither->state[0]);
+
+            v = ((q[i] >> 1) + (((int32_t)(r >> 16) +
+                                 (int32_t)(r & 0xffff) - 32767) >> 1)) >> 15;
+            d[i] = v > INT16_MAX ? INT16_MAX : v < INT16_MIN ? INT16_MIN : v;
+        }
+        return;
+    }
+
+#ifdef FORMAT_CONVERT_SSE2
+    {
+        __m128i one = _mm_set1_epi32(1);
+        __m128i lo, hi;
+
+        for (; i + 8 <= count; i += 8) {
+            lo = _mm_loadu_si128((const __m128i *)(q + i));
+            hi = _mm_loadu_si128((const __m128i *)(q + i + 4));
+            lo = _mm_srai_epi32(_mm_add_epi32(_mm_srai_epi32(lo, 15), one), 1);
+            hi = _mm_srai_epi32(_mm_add_epi32(_mm_srai_epi32(hi, 15), one), 1);
+            _mm_storeu_si128((__m128i *)(d + i), _mm_packs_epi32(lo, hi));
+        }
+    }
+#endif
+    for (; i < count; i++) {
+        v = ((q[i] >> 15) + 1) >> 1;
+        d[i] = v > INT16_MAX ? INT16_MAX : v;
+    }
+}
+
+static void from_q31(void *dst, enum sample_format format, const int32_t *q,
+                     size_t count, struct format_dither *dither)
+{
+    size_t i = 0;
+
+    switch (format) {
+    case SAMPLE_FORMAT_S16:
+        q31_to_s16(dst, q, count, dither);
+        break;
+    case SAMPLE_FORMAT_S24: {
+        int32_t *d = dst;
+
+        /* truncated, the error is far below the noise of the codecs */
+#ifdef FORMAT_CONVERT_SSE2
+        for (; i + 4 <= count; i += 4)
+            _mm_storeu_si128((__m128i *)(d + i), _mm_srai_epi32(
+                    _mm_loadu_si128((const __m128i *)(q + i)), 8));
+#endif
+        for (; i < count; i++)
+            d[i] = q[i] >> 8;
+        break;
+    }
+    case SAMPLE_FORMAT_FLOAT: {
+        float *d = dst;
+#ifdef FORMAT_CONVERT_SSE2
+        __m128 scale = _mm_set1_ps(1.0f / Q31_SCALE);
+
+        for (; i + 4 <= count; i += 4)
+            _mm_storeu_ps(d + i, _mm_mul_ps(_mm_cvtepi32_ps(
+                    _mm_loadu_si128((const __m128i *)(q + i))), scale));
+#endif
+        for (; i < count; i++)
+            d[i] = q[i] * (1.0f / Q31_SCALE);
+        break;
+    }
+    case SAMPLE_FORMAT_S32:
+    default:
+        memcpy(dst, q, count * sizeof(int32_t));
+        break;
+    }
+}
+
+void format_convert(void *dst, enum sample_format dst_format,
+                    const void *src, enum sample_format src_format,
+                    size_t count, struct format_dither *dither)
+{
+    int32_t block[FORMAT_BLOCK];
+    size_t dst_size = format_sample_size(dst_format);
+    size_t src_size = format_sample_size(src_format);
+    size_t n;
+
+    if (dst_format == src_format) {
+        memcpy(dst, src, count * src_size);
+        return;
+    }
+    if (src_format == SAMPLE_FORMAT_S32) {
+        from_q31(dst, dst_format, src, count, dither);
+        return;
+    }
+    if (dst_format == SAMPLE_FORMAT_S32) {
+        to_q31(dst, src, src_format, count);
+        return;
+    }
+
+    while (count > 0) {
+        n = count < FORMAT_BLOCK ? count : FORMAT_BLOCK;
+        to_q31(block, src, src_format, n);
+        from_q31(dst, dst_format, block, n, dither);
+        src = (const char *)src + n * src_size;
+        dst = (char *)dst + n * dst_size;
+        count -= n;
+    }
+}
@@ -0,0 +1,47 @@
+/*
+ * Copyright (C) 2012 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef FORMAT_CONVERT_H
+#define FORMAT_CONVERT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Sample formats the conversions handle */
+enum sample_format {
+    SAMPLE_FORMAT_S16,      /* int16_t */
+    SAMPLE_FORMAT_S24,      /* Q8.23 in an int32_t, as S24_LE and 8_24_BIT */
+    SAMPLE_FORMAT_S32,      /* Q0.31 in an int32_t */
+    SAMPLE_FORMAT_FLOAT,    /* float, full scale at 1.0 */
+};
+
+/* State of the noise generator of the dither */
+struct format_dither {
+    uint32_t state[4];
+};
+
+/* bytes of a sample */
+size_t format_sample_size(enum sample_format format);
+
+void format_dither_init(struct format_dither *dither, uint32_t seed);
+
+/* Converts count samples, saturating those out of range. Conversions to
+ * S16 of wider samples add TPDF dither of one LSB if dither is not NULL,
+ * and round otherwise. dst must not overlap src */
+void format_convert(void *dst, enum sample_format dst_format,
+                    const void *src, enum sample_format src_format,
+                    size_t count, struct format_dither *dither);
+#endif
@@ -0,0 +1,138 @@
+/*
+ * Copyright (C) 2012 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef HAL_STATS_H
+#define HAL_STATS_H
+
+/*
+ * Counters and histograms for the dump hooks of the HALs. They are updated
+ * with relaxed atomics, as they are only read by dumps, so updating them
+ * takes no lock. This is a header only so that the USB HAL, built as its
+ * own library, can share it.
+ */
+
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+
+/* bucket i counts the values below 2^(i + 1), the last one all the rest */
+#define STATS_HIST_BUCKETS 20
+
+struct stats_hist {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+    uint64_t bucket[STATS_HIST_BUCKETS];
+};
+
+static inline int64_t stats_now_us(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000LL + now.tv_nsec / 1000;
+}
+
+static inline void stats_add(uint64_t *counter, uint64_t value)
+{
+    __atomic_fetch_add(counter, value, __ATOMIC_RELAXED);
+}
+
+static inline void stats_inc(uint64_t *counter)
+{
+    stats_add(counter, 1);
+}
+
+static inline void stats_hist_add(struct stats_hist *hist, int64_t value)
+{
+    uint64_t max;
+    unsigned int i;
+
+    if (value < 0)
+        value = 0;
+    i = value ? 63 - __builtin_clzll(value) : 0;
+    if (i >= STATS_HIST_BUCKETS)
+        i = STATS_HIST_BUCKETS - 1;
+
+    __atomic_fetch_add(&hist->count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&hist->sum, value, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&hist->bucket[i], 1, __ATOMIC_RELAXED);
+
+    max = __atomic_load_n(&hist->max, __ATOMIC_RELAXED);
+    while ((uint64_t)value > max &&
+            !__atomic_compare_exchange_n(&hist->max, &max, value, true,
+                                         __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+/* adds the microseconds since start_us */
+static inline void stats_hist_add_since(struct stats_hist *hist,
+                                        int64_t start_us)
+{
+    stats_hist_add(hist, stats_now_us() - start_us);
+}
+
+static inline void stats_print(int fd, const char *format, ...)
+{
+    char buf[256];
+    va_list args;
+    int len;
+
+    va_start(args, format);
+    len = vsnprintf(buf, sizeof(buf), format, args);
+    va_end(args);
+    if (len > (int)sizeof(buf) - 1)
+        len = sizeof(buf) - 1;
+    if (len > 0)
+        write(fd, buf, len);
+}
+
+static inline void stats_print_count(int fd, const char *name,
+                                     const uint64_t *counter)
+{
+    stats_print(fd, "  %s: %llu\n", name, (unsigned long long)
+                __atomic_load_n(counter, __ATOMIC_RELAXED));
+}
+
+static inline void stats_print_hist(int fd, const char *name,
+                                    const char *unit,
+                                    const struct stats_hist *hist)
+{
+    uint64_t count = __atomic_load_n(&hist->count, __ATOMIC_RELAXED);
+    uint64_t sum = __atomic_load_n(&hist->sum, __ATOMIC_RELAXED);
+    uint64_t n;
+    unsigned int i;
+
+    stats_print(fd, "  %s: %llu, mean %llu %s, max %llu %s\n", name,
+                (unsigned long long)count,
+                (unsigned long long)(count ? sum / count : 0), unit,
+                (unsigned long long)__atomic_load_n(&hist->max,
+                                                    __ATOMIC_RELAXED), unit);
+    for (i = 0; i < STATS_HIST_BUCKETS; i++) {
+        n = __atomic_load_n(&hist->bucket[i], __ATOMIC_RELAXED);
+        if (!n)
+            continue;
+        if (i < STATS_HIST_BUCKETS - 1)
+            stats_print(fd, "    < %llu: %llu\n", 2ULL << i,
+                        (unsigned long long)n);
+        else
+            stats_print(fd, "    >= %llu: %llu\n", 1ULL << i,
+                        (unsigned long long)n);
+    }
+}
+#endif
@@ -0,0 +1,420 @@
+/*
+ * Copyright (C) 2012 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "poly_resampler"
+/*#define LOG_NDEBUG 0*/
+
+#include <errno.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <cutils/log.h>
+
+#include "poly_resampler.h"
+
+#if defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__))
+#define POLY_SSE2 1
+#include <emmintrin.h>
+#endif
+
+#define POLY_MAX_CHANNELS 2
+/* 44.1k <-> 48k needs 160 phases, 8k -> 44.1k needs 441 */
+#define POLY_MAX_PHASES 512
+#define POLY_MAX_TAPS 256
+/* input frames buffered on top of the filter length */
+#define POLY_CHUNK_FRAMES 256
+
+struct poly_tier {
+    unsigned int taps;      /* filter length in input frames, when upsampling */
+    double atten;           /* stopband attenuation in dB */
+};
+
+static const struct poly_tier poly_tiers[] = {
+    [POLY_RESAMPLER_LOW] = { 16, 50.0 },
+    [POLY_RESAMPLER_MEDIUM] = { 32, 75.0 },
+    [POLY_RESAMPLER_HIGH] = { 64, 90.0 },
+};
+
+/*
+ * Resampling by out_rate / in_rate = phases / step. Output frame n is
+ * filtered from the input frames starting at pos, with the coefficients of
+ * phase (n * step) % phases. Each channel has its own contiguous history
+ * so that a filter is a single dot product.
+ */
+struct poly_resampler {
+    struct resampler_itfe itfe;     /* first, so that it casts back */
+    struct resampler_buffer_provider *provider;
+    uint32_t in_rate;
+    uint32_t channels;
+
+    unsigned int phases;
+    unsigned int step;
+    unsigned int taps;              /* a multiple of 8 */
+    int16_t *coefs;                 /* phases x taps, Q15 */
+
+    int16_t *buf[POLY_MAX_CHANNELS];
+    size_t buf_frames;
+    size_t filled;                  /* frames in buf */
+    size_t pos;                     /* first frame of the next filter */
+    unsigned int phase;
+};
+
+static int16_t clamp16(int32_t sample)
+{
+    if (sample > INT16_MAX)
+        return INT16_MAX;
+    if (sample < INT16_MIN)
+        return INT16_MIN;
+    return sample;
+}
+
+#ifdef POLY_SSE2
+static int32_t poly_dot(const int16_t *x, const int16_t *h, unsigned int taps)
+{
+    __m128i acc = _mm_setzero_si128();
+    unsigned int i;
+
+    for (i = 0; i < taps; i += 8)
+        acc = _mm_add_epi32(acc,
+                _mm_madd_epi16(_mm_loadu_si128((const __m128i *)(x + i)),
+                               _mm_loadu_si128((const __m128i *)(h + i))));
+    acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, 0x4e));
+    acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, 0xb1));
+    return _mm_cvtsi128_si32(acc);
+}
+#else
+static int32_t poly_dot(const int16_t *x, const int16_t *h, unsigned int taps)
+{
+    int32_t acc = 0;
+    unsigned int i;
+
+    for (i = 0; i < taps; i++)
+        acc += (int32_t)x[i] * h[i];
+    return acc;
+}
+#endif
+
+static unsigned int gcd(unsigned int a, unsigned int b)
+{
+    unsigned int t;
+
+    while (b) {
+        t = a % b;
+        a = b;
+        b = t;
+    }
+    return a;
+}
+
+/* zeroth order modified Bessel function, for the Kaiser window */
+static double bessel_i0(double x)
+{
+    double sum = 1.0, term = 1.0;
+    int k;
+
+    for (k = 1; term > sum * 1e-12; k++) {
+        term *= (x / (2 * k)) * (x / (2 * k));
+        sum += term;
+    }
+    return sum;
+}
+
+/*
+ * Kaiser windowed sinc, designed at phases times the input rate and split
+ * into one filter per phase. The stopband starts at the lower of the two
+ * Nyquist frequencies, each phase is normalized to unity gain at DC.
+ */
+static int poly_design(struct poly_resampler *r, double ratio, double atten)
+{
+    unsigned int phases = r->phases, taps = r->taps;
+    unsigned int n, p, k, length = phases * taps;
+    double beta, width, cutoff, center, t, x, i0_beta, sum;
+    double *proto, *c;
+    int ret = -ENOMEM;
+
+    if (atten > 50.0)
+        beta = 0.1102 * (atten - 8.7);
+    else
+        beta = 0.5842 * pow(atten - 21.0, 0.4) + 0.07886 * (atten - 21.0);
+
+    /* transition width and cutoff in cycles per input frame */
+    width = (atten - 7.95) / (14.36 * taps);
+    cutoff = 0.5 * ratio - width / 2;
+    if (cutoff < 0.25 * ratio)
+        cutoff = 0.25 * ratio;
+
+    proto = malloc(length * sizeof(double));
+    c = malloc(taps * sizeof(double));
+    if (!proto || !c)
+        goto exit;
+
+    i0_beta = bessel_i0(beta);
+    center = (length - 1) / 2.0;
+    for (n = 0; n < length; n++) {
+        t = (n - center) / phases;
+        x = 2 * cutoff * t;
+        proto[n] = 2 * cutoff * (x == 0 ? 1.0 : sin(M_PI * x) / (M_PI * x));
+        x = 2.0 * n / (length - 1) - 1.0;
+        proto[n] *= bessel_i0(beta * sqrt(1.0 - x * x)) / i0_beta;
+    }
+
+    /* the last tap of a phase weighs the oldest frame */
+    for (p = 0; p < phases; p++) {
+        sum = 0;
+        for (k = 0; k < taps; k++) {
+            c[k] = proto[p + (taps - 1 - k) * phases];
+            sum += c[k];
+        }
+        for (k = 0; k < taps; k++)
+            r->coefs[p * taps + k] = clamp16(lrint(c[k] / sum * 32768.0));
+    }
+    ret = 0;
+
+exit:
+    free(proto);
+    free(c);
+    return ret;
+}
+
+static void poly_reset(struct resampler_itfe *resampler)
+{
+    struct poly_resampler *r = (struct poly_resampler *)resampler;
+    uint32_t ch;
+
+    /* half a filter of silence puts the first input frame at its center */
+    for (ch = 0; ch < r->channels; ch++)
+        memset(r->buf[ch], 0, r->buf_frames * sizeof(int16_t));
+    r->filled = r->taps / 2;
+    r->pos = 0;
+    r->phase = 0;
+}
+
+/* takes interleaved input frames, returns the number taken */
+static size_t poly_fill(struct poly_resampler *r, const int16_t *in,
+                        size_t frames)
+{
+    size_t i;
+    uint32_t ch;
+
+    if (r->pos) {
+        for (ch = 0; ch < r->channels; ch++)
+            memmove(r->buf[ch], r->buf[ch] + r->pos,
+                    (r->filled - r->pos) * sizeof(int16_t));
+        r->filled -= r->pos;
+        r->pos = 0;
+    }
+
+    if (frames > r->buf_frames - r->filled)
+        frames = r->buf_frames - r->filled;
+
+    if (r->channels == 1) {
+        memcpy(r->buf[0] + r->filled, in, frames * sizeof(int16_t));
+    } else {
+        for (i = 0; i < frames; i++) {
+            r->buf[0][r->filled + i] = in[i * 2];
+            r->buf[1][r->filled + i] = in[i * 2 + 1];
+        }
+    }
+    r->filled += frames;
+
+    return frames;
+}
+
+/* makes as many interleaved output frames as the buffered input allows */
+static size_t poly_produce(struct poly_resampler *r, int16_t *out,
+                           size_t frames)
+{
+    const int16_t *h;
+    size_t n;
+    uint32_t ch;
+
+    for (n = 0; n < frames && r->pos + r->taps <= r->filled; n++) {
+        h = r->coefs + r->phase * r->taps;
+        for (ch = 0; ch < r->channels; ch++)
+            *out++ = clamp16((poly_dot(r->buf[ch] + r->pos, h, r->taps) +
+                              (1 << 14)) >> 15);
+
+        r->phase += r->step;
+        r->pos += r->phase / r->phases;
+        r->phase %= r->phases;
+    }
+
+    return n;
+}
+
+static int poly_resample_from_input(struct resampler_itfe *resampler,
+                                    int16_t *in, size_t *in_frames,
+                                    int16_t *out, size_t *out_frames)
+{
+    struct poly_resampler *r = (struct poly_resampler *)resampler;
+    size_t in_done = 0, out_done = 0, frames;
+
+    if (!in || !in_frames || !out || !out_frames)
+        return -EINVAL;
+
+    for (;;) {
+        out_done += poly_produce(r, out + out_done * r->channels,
+                                 *out_frames - out_done);
+        if (out_done == *out_frames || in_done == *in_frames)
+            break;
+        frames = poly_fill(r, in + in_done * r->channels,
+                           *in_frames - in_done);
+        if (frames == 0)
+            break;
+        in_done += frames;
+    }
+
+    *in_frames = in_done;
+    *out_frames = out_done;
+    return 0;
+}
+
+static int poly_resample_from_provider(struct resampler_itfe *resampler,
+                                       int16_t *out, size_t *out_frames)
+{
+    struct poly_resampler *r = (struct poly_resampler *)resampler;
+    struct resampler_buffer buf;
+    size_t out_done = 0;
+
+    if (!r->provider || !out || !out_frames)
+        return -EINVAL;
+
+    for (;;) {
+        out_done += poly_produce(r, out + out_done * r->channels,
+                                 *out_frames - out_done);
+        if (out_done == *out_frames)
+            break;
+
+        /* ask for no more than fits, after poly_fill() compacts */
+        buf.raw = NULL;
+        buf.frame_count = r->buf_frames - (r->filled - r->pos);
+        r->provider->get_next_buffer(r->provider, &buf);
+        if (buf.raw == NULL || buf.frame_count == 0)
+            break;
+        buf.frame_count = poly_fill(r, buf.i16, buf.frame_count);
+        r->provider->release_buffer(r->provider, &buf);
+    }
+
+    *out_frames = out_done;
+    return 0;
+}
+
+/* the input frames buffered past the center of the filter */
+static int32_t poly_delay_ns(struct resampler_itfe *resampler)
+{
+    struct poly_resampler *r = (struct poly_resampler *)resampler;
+    size_t center = r->pos + r->taps / 2;
+
+    if (r->filled <= center)
+        return 0;
+    return (int32_t)((r->filled - center) * 1000000000LL / r->in_rate);
+}
+
+static void poly_free(struct poly_resampler *r)
+{
+    uint32_t ch;
+
+    for (ch = 0; ch < POLY_MAX_CHANNELS; ch++)
+        free(r->buf[ch]);
+    free(r->coefs);
+    free(r);
+}
+
+int poly_resampler_create(uint32_t in_rate, uint32_t out_rate,
+                          uint32_t channels,
+                          enum poly_resampler_quality quality,
+                          struct resampler_buffer_provider *provider,
+                          struct resampler_itfe **resampler)
+{
+    struct poly_resampler *r;
+    unsigned int div, taps;
+    double ratio;
+    uint32_t ch;
+
+    if (!resampler || in_rate == 0 || out_rate == 0 || channels == 0 ||
+            quality > POLY_RESAMPLER_HIGH)
+        return -EINVAL;
+
+    div = gcd(in_rate, out_rate);
+    if (channels > POLY_MAX_CHANNELS || out_rate / div > POLY_MAX_PHASES) {
+        ALOGW("no polyphase resampler for %u to %u Hz, %u channels",
+              in_rate, out_rate, channels);
+        return create_resampler(in_rate, out_rate, channels,
+                                quality == POLY_RESAMPLER_LOW ?
+                                        RESAMPLER_QUALITY_VOIP :
+                                        RESAMPLER_QUALITY_DEFAULT,
+                                provider, resampler);
+    }
+
+    /* downsampling keeps the same transition width relative to the output
+       rate, which takes proportionally more input frames */
+    ratio = out_rate < in_rate ? (double)out_rate / in_rate : 1.0;
+    taps = ((unsigned int)ceil(poly_tiers[quality].taps / ratio) + 7) & ~7;
+    if (taps > POLY_MAX_TAPS)
+        taps = POLY_MAX_TAPS;
+
+    r = calloc(1, sizeof(struct poly_resampler));
+    if (!r)
+        return -ENOMEM;
+
+    r->itfe.reset = poly_reset;
+    r->itfe.resample_from_provider = poly_resample_from_provider;
+    r->itfe.resample_from_input = poly_resample_from_input;
+    r->itfe.delay_ns = poly_delay_ns;
+    r->provider = provider;
+    r->in_rate = in_rate;
+    r->channels = channels;
+    r->phases = out_rate / div;
+    r->step = in_rate / div;
+    r->taps = taps;
+    r->buf_frames = taps + POLY_CHUNK_FRAMES;
+
+    r->coefs = malloc(r->phases * taps * sizeof(int16_t));
+    if (!r->coefs)
+        goto err;
+    for (ch = 0; ch < channels; ch++) {
+        r->buf[ch] = malloc(r->buf_frames * sizeof(int16_t));
+        if (!r->buf[ch])
+            goto err;
+    }
+
+    if (poly_design(r, ratio, poly_tiers[quality].atten) < 0)
+        goto err;
+    poly_reset(&r->itfe);
+
+    ALOGV("%u to %u Hz, %u channels: %u phases of %u taps", in_rate, out_rate,
+          channels, r->phases, taps);
+
+    *resampler = &r->itfe;
+    return 0;
+
+err:
+    poly_free(r);
+    return -ENOMEM;
+}
+
+void poly_resampler_release(struct resampler_itfe *resampler)
+{
+    if (!resampler)
+        return;
+
+    if (resampler->reset == poly_reset)
+        poly_free((struct poly_resampler *)resampler);
+    else
+        release_resampler(resampler);
+}
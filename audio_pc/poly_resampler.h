@@ -0,0 +1,42 @@
+/*
+ * Copyright (C) 2012 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef POLY_RESAMPLER_H
+#define POLY_RESAMPLER_H
+
+#include <stdint.h>
+
+#include <audio_utils/resampler.h>
+
+/* Quality tiers, each one costs about twice the CPU of the previous one */
+enum poly_resampler_quality {
+    POLY_RESAMPLER_LOW,     /* 16 taps, 50dB stopband, for voice */
+    POLY_RESAMPLER_MEDIUM,  /* 32 taps, 75dB stopband */
+    POLY_RESAMPLER_HIGH,    /* 64 taps, 90dB stopband, for music */
+};
+
+/* Creates a polyphase resampler for S16 frames of up to 2 channels, with
+ * the same interface as create_resampler(). Rate ratios it cannot handle
+ * fall back to the audio_utils resampler */
+int poly_resampler_create(uint32_t in_rate, uint32_t out_rate,
+                          uint32_t channels,
+                          enum poly_resampler_quality quality,
+                          struct resampler_buffer_provider *provider,
+                          struct resampler_itfe **resampler);
+
+/* Releases a resampler made by poly_resampler_create() */
+void poly_resampler_release(struct resampler_itfe *resampler);
+#endif
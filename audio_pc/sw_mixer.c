@@ -0,0 +1,179 @@
+/*
+ * Copyright (C) 2012 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "sw_mixer"
+/*#define LOG_NDEBUG 0*/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <cutils/atomic.h>
+#include <cutils/log.h>
+
+#include "sw_mixer.h"
+
+#if defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__))
+#define SW_MIXER_SSE2 1
+#include <emmintrin.h>
+#endif
+
+/*
+ * front and rear count the frames read and written since the ring was
+ * created, and wrap around. Each is only stored by its own side, with
+ * release semantics, so that the frames are visible before the count.
+ */
+struct sw_ring {
+    int16_t *data;
+    uint32_t frames;    /* a power of two */
+    unsigned int channels;
+    volatile int32_t front;
+    volatile int32_t rear;
+};
+
+struct sw_ring *sw_ring_create(size_t frames, unsigned int channels)
+{
+    struct sw_ring *ring;
+    uint32_t size = 1;
+
+    while (size < frames)
+        size <<= 1;
+
+    ring = calloc(1, sizeof(struct sw_ring));
+    if (!ring)
+        return NULL;
+    ring->data = malloc(size * channels * sizeof(int16_t));
+    if (!ring->data) {
+        free(ring);
+        return NULL;
+    }
+    ring->frames = size;
+    ring->channels = channels;
+
+    return ring;
+}
+
+void sw_ring_free(struct sw_ring *ring)
+{
+    if (!ring)
+        return;
+    free(ring->data);
+    free(ring);
+}
+
+size_t sw_ring_writable(struct sw_ring *ring)
+{
+    uint32_t front = android_atomic_acquire_load(&ring->front);
+
+    return ring->frames - ((uint32_t)ring->rear - front);
+}
+
+size_t sw_ring_readable(struct sw_ring *ring)
+{
+    uint32_t rear = android_atomic_acquire_load(&ring->rear);
+
+    return rear - (uint32_t)ring->front;
+}
+
+size_t sw_ring_write(struct sw_ring *ring, const int16_t *buffer,
+                     size_t frames)
+{
+    uint32_t rear = ring->rear;
+    uint32_t offset = rear & (ring->frames - 1);
+    size_t writable = sw_ring_writable(ring);
+    size_t part;
+
+    if (frames > writable)
+        frames = writable;
+
+    part = ring->frames - offset;
+    if (part > frames)
+        part = frames;
+    memcpy(ring->data + offset * ring->channels, buffer,
+           part * ring->channels * sizeof(int16_t));
+    memcpy(ring->data, buffer + part * ring->channels,
+           (frames - part) * ring->channels * sizeof(int16_t));
+
+    android_atomic_release_store(rear + frames, &ring->rear);
+    return frames;
+}
+
+size_t sw_ring_mix(struct sw_ring *ring, int32_t *mix, size_t frames)
+{
+    uint32_t front = ring->front;
+    uint32_t offset = front & (ring->frames - 1);
+    size_t readable = sw_ring_readable(ring);
+    size_t part;
+
+    if (frames > readable)
+        frames = readable;
+
+    part = ring->frames - offset;
+    if (part > frames)
+        part = frames;
+    sw_mix_accumulate(mix, ring->data + offset * ring->channels,
+                      part * ring->channels);
+    sw_mix_accumulate(mix + part * ring->channels, ring->data,
+                      (frames - part) * ring->channels);
+
+    android_atomic_release_store(front + frames, &ring->front);
+    return frames;
+}
+
+/*
+ * The samples are summed at 32 bits and only saturated once all the
+ * streams are in, so a peak that cancels out across streams does not
+ * clip.
+ */
+void sw_mix_accumulate(int32_t *mix, const int16_t *src, size_t count)
+{
+    size_t i = 0;
+
+#ifdef SW_MIXER_SSE2
+    __m128i s, lo, hi;
+
+    for (; i + 8 <= count; i += 8) {
+        s = _mm_loadu_si128((const __m128i *)(src + i));
+        lo = _mm_srai_epi32(_mm_unpacklo_epi16(s, s), 16);
+        hi = _mm_srai_epi32(_mm_unpackhi_epi16(s, s), 16);
+        _mm_storeu_si128((__m128i *)(mix + i),
+                _mm_add_epi32(_mm_loadu_si128((__m128i *)(mix + i)), lo));
+        _mm_storeu_si128((__m128i *)(mix + i + 4),
+                _mm_add_epi32(_mm_loadu_si128((__m128i *)(mix + i + 4)), hi));
+    }
+#endif
+    for (; i < count; i++)
+        mix[i] += src[i];
+}
+
+void sw_mix_saturate(int16_t *dst, const int32_t *mix, size_t count)
+{
+    size_t i = 0;
+
+#ifdef SW_MIXER_SSE2
+    for (; i + 8 <= count; i += 8)
+        _mm_storeu_si128((__m128i *)(dst + i),
+                _mm_packs_epi32(_mm_loadu_si128((const __m128i *)(mix + i)),
+                        _mm_loadu_si128((const __m128i *)(mix + i + 4))));
+#endif
+    for (; i < count; i++) {
+        if (mix[i] > INT16_MAX)
+            dst[i] = INT16_MAX;
+        else if (mix[i] < INT16_MIN)
+            dst[i] = INT16_MIN;
+        else
+            dst[i] = mix[i];
+    }
+}
@@ -0,0 +1,52 @@
+/*
+ * Copyright (C) 2012 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SW_MIXER_H
+#define SW_MIXER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Ring buffer of S16 frames with a single producer and a single consumer,
+ * which need no lock between them.
+ */
+struct sw_ring;
+
+/* frames is rounded up to a power of two */
+struct sw_ring *sw_ring_create(size_t frames, unsigned int channels);
+void sw_ring_free(struct sw_ring *ring);
+
+/* frames that can be written now, producer side */
+size_t sw_ring_writable(struct sw_ring *ring);
+
+/* frames that can be read now, consumer side */
+size_t sw_ring_readable(struct sw_ring *ring);
+
+/* Writes up to frames frames, returns the number written. Producer side */
+size_t sw_ring_write(struct sw_ring *ring, const int16_t *buffer,
+                     size_t frames);
+
+/* Reads up to frames frames and adds them to the samples of mix, returns
+ * the number read. Consumer side */
+size_t sw_ring_mix(struct sw_ring *ring, int32_t *mix, size_t frames);
+
+/* Adds count samples of src to mix */
+void sw_mix_accumulate(int32_t *mix, const int16_t *src, size_t count);
+
+/* Saturates count mixed samples to S16 */
+void sw_mix_saturate(int16_t *dst, const int32_t *mix, size_t count);
+#endif